@@ -14,6 +14,8 @@
 
 // Retrieve an FT_Face from the cache and assigns it to the face pointer. The
 // retrieved face should be destroyed with FT_Done_Face once no longer needed.
+// If called from another thread than the main R thread, the face belongs to
+// that thread's cache and should only be used and destroyed there.
 // Returns 0 if successful.
 static inline FT_Face get_cached_face(const char* fontfile, int index,
                                       double size, double res, int* error) {
@@ -18,6 +18,14 @@
 #include <string.h>
 #endif
 
+// Functions that work directly on a font file (glyph_metrics, string_width,
+// string_widths, string_shape, get_font_weight, get_font_family, and
+// get_cached_face from systemfonts-ft.h) may be called from threads other than
+// the main R thread. Each thread gets its own FreeType cache. The first call to
+// each function looks it up with R_GetCCallable() so this should happen on the
+// main thread. Font lookup by family name (locate_font etc.) and fallback
+// lookup must still happen on the main thread.
+
 struct FontFeature {
   char feature[4];
   int setting;
@@ -59,6 +67,25 @@ struct FontSettings2 : public FontSettings {
 };
 typedef struct FontSettings2 FontSettings2;
 
+// Counters for one of the caches in systemfonts (see cache_stats()). Hits,
+// misses and evictions are counted since the last reset while entries and
+// bytes describe the current content of the cache
+struct FontCacheStats {
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+  size_t entries;
+  size_t bytes;
+};
+typedef struct FontCacheStats FontCacheStats;
+
+// Number of calls to, and time spent in, a FreeType operation (see timing_stats())
+struct FontTimingStats {
+  size_t calls;
+  double seconds;
+};
+typedef struct FontTimingStats FontTimingStats;
+
 // Get the file and index of a font given by its name, along with italic and
 // bold status. Writes filepath to `path` and returns the index
 static inline int locate_font(const char *family, int italic, int bold, char *path, int max_path_length) {
@@ -196,6 +223,18 @@ namespace systemfonts {
       }
       return p_get_fallback(string, font);
     }
+    // Split a UTF-32 string into runs that can each be rendered with a single
+    // font. Codepoints the font doesn't have get a fallback font. The exclusive
+    // end of each run is written to run_end and its font to run_font, for at
+    // most max_runs runs. Returns the total number of runs which may be larger
+    // than max_runs
+    static inline int font_runs(const uint32_t* string, int n, const FontSettings2& font, int* run_end, FontSettings2* run_font, int max_runs) {
+      static int (*p_font_runs)(const uint32_t*, int, const FontSettings2&, int*, FontSettings2*, int) = NULL;
+      if (p_font_runs == NULL) {
+        p_font_runs = (int (*)(const uint32_t*, int, const FontSettings2&, int*, FontSettings2*, int)) R_GetCCallable("systemfonts", "font_runs");
+      }
+      return p_font_runs(string, n, font, run_end, run_font, max_runs);
+    }
     // Get ascent, descent, and width of a glyph, given by its unicode number,
     // fontfile and index, along with its size and the resolution. Returns 0 if
     // successful
@@ -206,6 +245,17 @@ namespace systemfonts {
       }
       return p_glyph_metrics(code, font, size, res, ascent, descent, width);
     }
+    // Calculate the width of multiple strings at once. `fonts` and `size` must
+    // hold an element for each string. Strings are grouped by font internally
+    // so each font is only activated once. Widths are written to the `widths`
+    // array. Returns 0 if successful
+    static inline int string_widths(const char** strings, int n_strings, const FontSettings2* fonts, const double* size, double res, int include_bearing, double* widths) {
+      static int (*p_string_widths)(const char**, int, const FontSettings2*, const double*, double, int, double*) = NULL;
+      if (p_string_widths == NULL) {
+        p_string_widths = (int (*)(const char**, int, const FontSettings2*, const double*, double, int, double*)) R_GetCCallable("systemfonts", "string_widths");
+      }
+      return p_string_widths(strings, n_strings, fonts, size, res, include_bearing, widths);
+    }
     // Get the weight of the font as encoded in the OTT/2 table
     static inline int get_font_weight(const FontSettings2& font) {
       static int (*p_get_weight)(const FontSettings2&) = NULL;
@@ -250,5 +300,34 @@ namespace systemfonts {
       }
       return p_get_glyph_raster(glyph, font, size, res, color);
     }
+    // Get the counters for one of the caches: "face", "size", "glyph", "shape",
+    // "width", "font_location", or "fallback". All but "font_location" are kept
+    // per thread and the counters of the calling thread are returned. Returns 0 if
+    // successful and 1 if the cache is unknown
+    static inline int cache_stats(const char* cache, FontCacheStats* stats) {
+      static int (*p_cache_stats)(const char*, FontCacheStats*) = NULL;
+      if (p_cache_stats == NULL) {
+        p_cache_stats = (int (*)(const char*, FontCacheStats*)) R_GetCCallable("systemfonts", "cache_stats");
+      }
+      return p_cache_stats(cache, stats);
+    }
+    // Get the time the calling thread has spent in "new_face", "new_size", or
+    // "load_glyph". Returns 0 if successful and 1 if the operation is unknown
+    static inline int timing_stats(const char* operation, FontTimingStats* stats) {
+      static int (*p_timing_stats)(const char*, FontTimingStats*) = NULL;
+      if (p_timing_stats == NULL) {
+        p_timing_stats = (int (*)(const char*, FontTimingStats*)) R_GetCCallable("systemfonts", "timing_stats");
+      }
+      return p_timing_stats(operation, stats);
+    }
+    // Reset all counters and timings of the calling thread along with the
+    // counters of the shared caches
+    static inline void reset_cache_stats() {
+      static void (*p_reset_cache_stats)() = NULL;
+      if (p_reset_cache_stats == NULL) {
+        p_reset_cache_stats = (void (*)()) R_GetCCallable("systemfonts", "reset_cache_stats");
+      }
+      p_reset_cache_stats();
+    }
   }
 }
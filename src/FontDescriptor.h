@@ -103,9 +103,6 @@ public:
   bool italic;
   bool monospace;
   bool variable;
-  bool var_wght;
-  bool var_wdth;
-  bool var_ital;
 
   FontDescriptor() {
     path = NULL;
@@ -118,7 +115,7 @@ public:
     italic = false;
     monospace = false;
     variable = false;
-    add_var_flags();
+    reset_var_flags();
   }
 
   // Constructor added by Thomas Lin Pedersen
@@ -133,7 +130,7 @@ public:
     this->italic = italic;
     this->monospace = false;
     this->variable = false;
-    add_var_flags();
+    reset_var_flags();
   }
 
   // Constructor added by Thomas Lin Pedersen
@@ -148,14 +145,14 @@ public:
     this->italic = italic;
     this->monospace = false;
     this->variable = false;
-    add_var_flags();
+    reset_var_flags();
   }
 
   // Constructor added by Thomas Lin Pedersen
   FontDescriptor(FT_Face face, const char* path, int index, bool variable = false) {
     this->path = copyString(path);
     this->index = index;
-    this->postscriptName = FT_Get_Postscript_Name(face) == NULL ? "" : copyString(FT_Get_Postscript_Name(face));
+    this->postscriptName = copyString(FT_Get_Postscript_Name(face) == NULL ? "" : FT_Get_Postscript_Name(face));
     this->family = copyString(face->family_name);
     this->style = copyString(face->style_name);
     this->weight = get_font_weight(face);
@@ -163,7 +160,7 @@ public:
     this->italic = face->style_flags & FT_STYLE_FLAG_ITALIC;
     this->monospace = FT_IS_FIXED_WIDTH(face);
     this->variable = variable;
-    add_var_flags();
+    reset_var_flags();
   }
 
   FontDescriptor(const char *path, const char *postscriptName, const char *family, const char *style,
@@ -178,7 +175,7 @@ public:
     this->italic = italic;
     this->monospace = monospace;
     this->variable = variable;
-    add_var_flags();
+    reset_var_flags();
   }
 
   FontDescriptor(const char *path, int index, const char *postscriptName, const char *family, const char *style,
@@ -193,7 +190,7 @@ public:
     this->italic = italic;
     this->monospace = monospace;
     this->variable = variable;
-    add_var_flags();
+    reset_var_flags();
   }
 
   FontDescriptor(FontDescriptor *desc) {
@@ -207,11 +204,29 @@ public:
     italic = desc->italic;
     monospace = desc->monospace;
     variable = desc->variable;
+    var_resolved = desc->var_resolved;
     var_wght = desc->var_wght;
     var_wdth = desc->var_wdth;
     var_ital = desc->var_ital;
   }
 
+  // Whether the font has a weight, width, or italic axis. These are looked up
+  // the first time they are needed so that listing fonts doesn't open them
+  bool has_var_wght() {
+    resolve_var_flags();
+    return var_wght;
+  }
+
+  bool has_var_wdth() {
+    resolve_var_flags();
+    return var_wdth;
+  }
+
+  bool has_var_ital() {
+    resolve_var_flags();
+    return var_ital;
+  }
+
   const char* get_path() {
     return path == NULL ? "" : path;
   }
@@ -290,13 +305,13 @@ public:
     if (style && !strcmp_no_case(style, other.style))
       return false;
 
-    if (weight && !var_wght && !other.var_wght && weight != other.weight)
+    if (weight && weight != other.weight && !has_var_wght() && !other.has_var_wght())
       return false;
 
-    if (width &&  !var_wdth && !other.var_wdth && width != other.width)
+    if (width && width != other.width && !has_var_wdth() && !other.has_var_wdth())
       return false;
 
-    if (!var_ital && !other.var_ital && italic != other.italic)
+    if (italic != other.italic && !has_var_ital() && !other.has_var_ital())
       return false;
 
     return true;
@@ -316,18 +331,24 @@ private:
     strcpy(str, input);
     return str;
   }
-  void add_var_flags() {
-    if (variable && path != NULL) {
-      FreetypeCache& cache = get_font_cache();
-      if (cache.load_font(path, 0)) {
-        cache.has_axes(var_wght, var_wdth, var_ital);
-        return;
-      }
-    }
+  bool var_resolved;
+  bool var_wght;
+  bool var_wdth;
+  bool var_ital;
+
+  void reset_var_flags() {
+    var_resolved = !variable || path == NULL;
     var_wght = false;
     var_wdth = false;
     var_ital = false;
   }
+  void resolve_var_flags() {
+    if (var_resolved) {
+      return;
+    }
+    font_file_axes(intern_font_file(path), var_wght, var_wdth, var_ital);
+    var_resolved = true;
+  }
 };
 
 class ResultSet : public std::vector<FontDescriptor *> {
@@ -340,6 +361,13 @@ public:
   int n_fonts() {
     return size();
   }
+  // Like clear() but also frees the descriptors
+  void delete_all() {
+    for (ResultSet::iterator it = this->begin(); it != this->end(); it++) {
+      delete *it;
+    }
+    this->clear();
+  }
 };
 
 #endif
@@ -0,0 +1,169 @@
+#include "cache_file.h"
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// A read-only mapping of a full font file
+class MappedFile {
+public:
+  MappedFile(const std::string& path) :
+  _path(path),
+  _data(nullptr),
+  _size(0) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+      return;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+      CloseHandle(file);
+      return;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) {
+      return;
+    }
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (data == NULL) {
+      return;
+    }
+    _data = data;
+    _size = (size_t) size.QuadPart;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+      close(fd);
+      return;
+    }
+    void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      return;
+    }
+    _data = data;
+    _size = (size_t) info.st_size;
+#endif
+  }
+
+  ~MappedFile();
+
+  inline bool valid() const {
+    return _data != nullptr;
+  }
+
+  inline const FT_Byte* data() const {
+    return static_cast<const FT_Byte*>(_data);
+  }
+
+  inline size_t size() const {
+    return _size;
+  }
+
+private:
+  std::string _path;
+  void* _data;
+  size_t _size;
+};
+
+// Mapped files are tracked by path so that faces from the same file share the
+// mapping. The registry is never destroyed so that faces released during
+// shutdown can still unregister
+typedef std::unordered_map<std::string, std::weak_ptr<MappedFile> > file_map_t;
+static std::mutex& file_map_mutex() {
+  static std::mutex* mutex = new std::mutex();
+  return *mutex;
+}
+static file_map_t& file_map() {
+  static file_map_t* files = new file_map_t();
+  return *files;
+}
+
+MappedFile::~MappedFile() {
+  // Files that failed to map are never registered
+  if (_data == nullptr) {
+    return;
+  }
+#ifdef _WIN32
+  UnmapViewOfFile(_data);
+#else
+  munmap(_data, _size);
+#endif
+  std::lock_guard<std::mutex> lock(file_map_mutex());
+  file_map_t::iterator it = file_map().find(_path);
+  // The path may already have been mapped anew
+  if (it != file_map().end() && it->second.expired()) {
+    file_map().erase(it);
+  }
+}
+
+static std::shared_ptr<MappedFile> get_mapped_file(const std::string& path) {
+  std::lock_guard<std::mutex> lock(file_map_mutex());
+  std::weak_ptr<MappedFile>& slot = file_map()[path];
+  std::shared_ptr<MappedFile> file = slot.lock();
+  if (!file) {
+    file = std::make_shared<MappedFile>(path);
+    if (!file->valid()) {
+      file_map().erase(path);
+      return std::shared_ptr<MappedFile>();
+    }
+    slot = file;
+  }
+  return file;
+}
+
+// FreeType reads a memory based stream directly from its base pointer. The
+// stream holds on to the mapping until FreeType closes it when the face is done
+struct MappedStream {
+  FT_StreamRec stream;
+  std::shared_ptr<MappedFile> file;
+};
+
+static void close_mapped_stream(FT_Stream stream) {
+  delete static_cast<MappedStream*>(stream->descriptor.pointer);
+}
+
+FT_Error open_mapped_face(FT_Library library, const char* path, FT_Long index,
+                          FT_Face* face) {
+  std::shared_ptr<MappedFile> file = get_mapped_file(path);
+  if (!file) {
+    return FT_New_Face(library, path, index, face);
+  }
+
+  MappedStream* mapped = new MappedStream();
+  mapped->file = file;
+  FT_Stream stream = &(mapped->stream);
+  stream->base = const_cast<FT_Byte*>(file->data());
+  stream->size = file->size();
+  stream->pos = 0;
+  stream->descriptor.pointer = mapped;
+  stream->read = NULL;
+  stream->close = close_mapped_stream;
+
+  FT_Open_Args args;
+  memset(&args, 0, sizeof(FT_Open_Args));
+  args.flags = FT_OPEN_STREAM;
+  args.stream = stream;
+  // FreeType closes the stream, and thereby frees it, if opening fails
+  return FT_Open_Face(library, &args, index, face);
+}
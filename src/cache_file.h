@@ -0,0 +1,12 @@
+#pragma once
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+// Open a face from a memory mapped font file. Each file is mapped once and the
+// mapping is shared between all faces opened from it, across collection
+// indices and threads. It is released once the last face using it is done,
+// which may be later than its removal from the cache if the face has been
+// referenced elsewhere. Falls back to FT_New_Face() if the file can't be mapped
+FT_Error open_mapped_face(FT_Library library, const char* path, FT_Long index,
+                          FT_Face* face);
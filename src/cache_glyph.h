@@ -0,0 +1,266 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <bitset>
+#include <limits>
+#include <cstdint>
+#include <cstddef>
+
+// Compact glyph metrics. Kept as a POD so it can be copied around without
+// allocating. The glyph name is not stored and must be fetched from the face
+// if needed
+struct GlyphInfo {
+  unsigned index;
+  long x_bearing;
+  long y_bearing;
+  long width;
+  long height;
+  long x_advance;
+  long y_advance;
+  long bbox[4];
+};
+
+// Kerning between a pair of glyphs
+struct KerningInfo {
+  long x;
+  long y;
+};
+
+// Open-addressing hash table with linear probing for integer keys. The largest
+// representable key is reserved for marking free slots
+template<typename key_t, typename value_t>
+class FlatMap {
+public:
+  FlatMap() :
+  _n(0),
+  _table() {
+
+  }
+
+  // Retrieve the value for a key, returning true if it was found
+  inline bool get(key_t key, value_t& value) const {
+    if (_table.empty()) {
+      return false;
+    }
+    size_t mask = _table.size() - 1;
+    for (size_t i = hash(key) & mask; ; i = (i + 1) & mask) {
+      const entry_t& entry = _table[i];
+      if (entry.key == key) {
+        value = entry.value;
+        return true;
+      }
+      if (entry.key == EMPTY) {
+        return false;
+      }
+    }
+  }
+
+  // Add (or overwrite) the value for a key
+  inline void add(key_t key, const value_t& value) {
+    if ((_n + 1) * 2 > _table.size()) {
+      grow();
+    }
+    if (insert(key, value)) {
+      _n++;
+    }
+  }
+
+  inline size_t size() const {
+    return _n;
+  }
+
+  // Memory held by the table
+  inline size_t bytes() const {
+    return _table.capacity() * sizeof(entry_t);
+  }
+
+  // Clear the table while keeping the allocated memory around
+  inline void clear() {
+    for (size_t i = 0; i < _table.size(); ++i) {
+      _table[i].key = EMPTY;
+    }
+    _n = 0;
+  }
+
+private:
+  static const key_t EMPTY = std::numeric_limits<key_t>::max();
+
+  struct entry_t {
+    key_t key;
+    value_t value;
+  };
+
+  size_t _n;
+  std::vector<entry_t> _table;
+
+  static inline size_t hash(key_t key) {
+    // Fibonacci hashing to spread consecutive keys across the table
+    uint64_t k = (uint64_t) key;
+    k ^= k >> 29;
+    return (size_t) ((k * UINT64_C(11400714819323198485)) >> 32);
+  }
+
+  // Returns true if a new slot was taken
+  inline bool insert(key_t key, const value_t& value) {
+    size_t mask = _table.size() - 1;
+    for (size_t i = hash(key) & mask; ; i = (i + 1) & mask) {
+      entry_t& entry = _table[i];
+      if (entry.key == key) {
+        entry.value = value;
+        return false;
+      }
+      if (entry.key == EMPTY) {
+        entry.key = key;
+        entry.value = value;
+        return true;
+      }
+    }
+  }
+
+  inline void grow() {
+    std::vector<entry_t> old;
+    old.swap(_table);
+    entry_t empty = {};
+    empty.key = EMPTY;
+    _table.assign(old.empty() ? 64 : old.size() * 2, empty);
+    for (size_t i = 0; i < old.size(); ++i) {
+      if (old[i].key != EMPTY) {
+        insert(old[i].key, old[i].value);
+      }
+    }
+  }
+};
+
+// Glyph metrics keyed by unicode codepoint. Codepoints in the Latin-1 range are
+// stored in a directly indexed array while the rest lives in a flat hash table
+class GlyphStore {
+public:
+  GlyphStore() :
+  _direct(),
+  _direct_set(),
+  _table() {
+
+  }
+
+  // Retrieve the metrics for a codepoint, returning true if it was found
+  inline bool get(uint32_t code, GlyphInfo& info) const {
+    if (code < DIRECT_SIZE) {
+      if (!_direct_set[code]) {
+        return false;
+      }
+      info = _direct[code];
+      return true;
+    }
+    return _table.get(code, info);
+  }
+
+  // Add (or overwrite) the metrics for a codepoint
+  inline void add(uint32_t code, const GlyphInfo& info) {
+    if (code < DIRECT_SIZE) {
+      if (_direct.empty()) {
+        _direct.resize(DIRECT_SIZE);
+      }
+      _direct[code] = info;
+      _direct_set[code] = true;
+      return;
+    }
+    _table.add(code, info);
+  }
+
+  inline size_t size() const {
+    return _table.size() + _direct_set.count();
+  }
+
+  inline size_t bytes() const {
+    return sizeof(GlyphStore) + _direct.capacity() * sizeof(GlyphInfo) + _table.bytes();
+  }
+
+  inline void clear() {
+    _direct_set.reset();
+    _table.clear();
+  }
+
+private:
+  static const uint32_t DIRECT_SIZE = 256;
+
+  std::vector<GlyphInfo> _direct;
+  std::bitset<DIRECT_SIZE> _direct_set;
+  FlatMap<uint32_t, GlyphInfo> _table;
+};
+
+// Kerning keyed by pairs of glyph ids. Pairs where both glyphs have a low id
+// (which usually covers the basic Latin glyphs) and only a small horizontal
+// kerning are stored in dense rows, allocated the first time a glyph is kerned
+// on the left. Everything else goes in a flat hash table
+class KerningStore {
+public:
+  KerningStore() :
+  _rows(),
+  _dense(),
+  _table() {
+
+  }
+
+  // Retrieve the kerning for a glyph pair, returning true if it was found
+  inline bool get(uint32_t left, uint32_t right, KerningInfo& kern) const {
+    if (left < DENSE_SIZE && right < DENSE_SIZE && !_rows.empty() && _rows[left] != 0) {
+      int16_t x = _dense[(_rows[left] - 1) * DENSE_SIZE + right];
+      if (x != UNSET) {
+        kern.x = x;
+        kern.y = 0;
+        return true;
+      }
+    }
+    return _table.get(pair_key(left, right), kern);
+  }
+
+  inline void add(uint32_t left, uint32_t right, const KerningInfo& kern) {
+    if (left < DENSE_SIZE && right < DENSE_SIZE && kern.y == 0 &&
+        kern.x > UNSET && kern.x <= std::numeric_limits<int16_t>::max()) {
+      dense_row(left)[right] = (int16_t) kern.x;
+      return;
+    }
+    if (left < DENSE_SIZE && right < DENSE_SIZE && !_rows.empty() && _rows[left] != 0) {
+      _dense[(_rows[left] - 1) * DENSE_SIZE + right] = UNSET;
+    }
+    _table.add(pair_key(left, right), kern);
+  }
+
+  // Memory held by the store
+  inline size_t bytes() const {
+    return sizeof(KerningStore) + _rows.capacity() * sizeof(uint8_t) +
+      _dense.capacity() * sizeof(int16_t) + _table.bytes();
+  }
+
+  // Clear the store while keeping the allocated memory around
+  inline void clear() {
+    std::fill(_rows.begin(), _rows.end(), 0);
+    _dense.clear();
+    _table.clear();
+  }
+
+private:
+  static const uint32_t DENSE_SIZE = 128;
+  static const int16_t UNSET = std::numeric_limits<int16_t>::min();
+
+  // 1-based index of the dense row for each left glyph, 0 if it has none
+  std::vector<uint8_t> _rows;
+  std::vector<int16_t> _dense;
+  FlatMap<uint64_t, KerningInfo> _table;
+
+  inline int16_t* dense_row(uint32_t left) {
+    if (_rows.empty()) {
+      _rows.assign(DENSE_SIZE, 0);
+    }
+    if (_rows[left] == 0) {
+      _dense.insert(_dense.end(), DENSE_SIZE, int16_t(UNSET));
+      _rows[left] = _dense.size() / DENSE_SIZE;
+    }
+    return &(_dense[(_rows[left] - 1) * DENSE_SIZE]);
+  }
+
+  static inline uint64_t pair_key(uint32_t left, uint32_t right) {
+    return ((uint64_t) left << 32) | right;
+  }
+};
@@ -1,147 +1,470 @@
 #pragma once
 
-#include <unordered_map>
-#include <list>
+#include <vector>
+#include <atomic>
 #include <functional>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
 
-template<typename key_t, typename value_t>
+// A least recently used cache. Key-value pairs live in a slab of nodes which
+// are linked together in order of use and chained into hash buckets by index.
+// Nodes of removed pairs are reused so, once the slab has grown to the size of
+// the cache, neither lookups nor additions allocate. Keys are stored once along
+// with their hash so every operation hashes its key a single time.
+//
+// Lookups accept any key type that hash_t and equal_t can handle, so a cheap,
+// non-owning version of the key can be used. It must hash to the same value as
+// the corresponding key_t and equal_t gets the lookup key as first argument and
+// the stored key as second
+template<typename key_t, typename value_t, typename hash_t = std::hash<key_t>, typename equal_t = std::equal_to<key_t> >
 class LRU_Cache {
-  
+
 public:
   LRU_Cache() :
-  _max_size(32) {
-    
+  _max_size(32),
+  _max_cost(0),
+  _hits(0),
+  _misses(0),
+  _evictions(0) {
+    init();
   }
   LRU_Cache(size_t max_size) :
-  _max_size(max_size) {
-    
+  _max_size(max_size),
+  _max_cost(0),
+  _hits(0),
+  _misses(0),
+  _evictions(0) {
+    init();
+  }
+  LRU_Cache(size_t max_size, size_t max_cost) :
+  _max_size(max_size),
+  _max_cost(max_cost),
+  _hits(0),
+  _misses(0),
+  _evictions(0) {
+    init();
   }
-  
+
   ~LRU_Cache() {
     clear();
   }
-  
-  // Add a key-value pair, potentially passing a removed key and value back 
-  // through the removed_key and removed_value argument. Returns true if a value 
-  // was removed and false otherwise
+
+  // Add a key-value pair, potentially passing a removed key and value back
+  // through the removed_key and removed_value argument. Returns true if a value
+  // was removed and false otherwise. The key and value are moved into the cache
   inline bool add(key_t key, value_t value, key_t& removed_key, value_t& removed_value) {
-    cache_map_it_t it = _cache_map.find(key);
-    _cache_list.push_front(key_value_t(key, value));
-    if (it != _cache_map.end()) {
-      _cache_list.erase(it->second);
-      _cache_map.erase(it);
-    }
-    _cache_map[key] = _cache_list.begin();
-    
-    if (_cache_map.size() > _max_size) {
-      cache_list_it_t last = _cache_list.end();
-      last--;
-      removed_key = last->first;
-      removed_value = last->second;
-      _cache_map.erase(last->first);
-      _cache_list.pop_back();
-      return true;
-    }
-    return false;
-  }
-  
-  // Add a key-value pair, potentially passing a value back through the 
-  // removed_value argument. Returns true if a value was removed and false 
+    size_t hash = _hasher(key);
+    index_t i = find_node(key, hash);
+    if (i == NONE) {
+      i = new_node();
+      _nodes[i].key = std::move(key);
+      _nodes[i].hash = hash;
+      link_bucket(i);
+      link_front(i);
+      _n++;
+      if (_n > _buckets.size()) {
+        rehash(_buckets.size() * 2);
+      }
+    } else {
+      _cost -= _nodes[i].cost;
+      unlink(i);
+      link_front(i);
+    }
+    node_t& node = _nodes[i];
+    node.value = std::move(value);
+    node.cost = key_cost(node.key) + value_cost(node.value);
+    _cost += node.cost;
+
+    return trim(removed_key, removed_value);
+  }
+
+  // Remove the least recently used key-value pair if the cache holds more
+  // pairs than allowed or if their combined cost exceeds the budget, passing it
+  // back through the removed_key and removed_value argument. The most recently
+  // used pair is never removed. Returns true if a value was removed. As a
+  // single call removes at most one pair it should be called until it returns
+  // false to get within budget
+  inline bool trim(key_t& removed_key, value_t& removed_value) {
+    if (_n <= 1) {
+      return false;
+    }
+    if (_n <= _max_size && (_max_cost == 0 || _cost <= _max_cost)) {
+      return false;
+    }
+    index_t last = _tail;
+    removed_key = std::move(_nodes[last].key);
+    removed_value = std::move(_nodes[last].value);
+    _evictions++;
+    free_node(last);
+    return true;
+  }
+
+  // Trim the cache, potentially passing a key back through the removed_key
+  // argument. Returns true if a value was removed and false otherwise. Will
+  // destroy the value
+  inline bool trim(key_t& removed_key) {
+    value_t removed_value;
+    bool overflow = trim(removed_key, removed_value);
+    if (overflow) {
+      value_dtor(removed_value);
+    }
+    return overflow;
+  }
+
+  // Add a key-value pair, potentially passing a value back through the
+  // removed_value argument. Returns true if a value was removed and false
   // otherwise
   inline bool add(key_t key, value_t value, value_t& removed_value) {
     key_t removed_key;
-    return add(key, value, removed_key, removed_value);
+    return add(std::move(key), std::move(value), removed_key, removed_value);
   }
-  
-  // Add a key-value pair, potentially passing a key back through the 
-  // removed_key argument. Returns true if a value was removed and false 
+
+  // Add a key-value pair, potentially passing a key back through the
+  // removed_key argument. Returns true if a value was removed and false
   // otherwise. Will destroy the value
   inline bool add(key_t key, value_t value, key_t& removed_key) {
     value_t removed_value;
-    bool overflow = add(key, value, removed_key, removed_value);
+    bool overflow = add(std::move(key), std::move(value), removed_key, removed_value);
     if (overflow) {
       value_dtor(removed_value);
     }
     return overflow;
   }
-  
-  // Add a key-value pair, automatically destroying any removed value
+
+  // Add a key-value pair, automatically destroying any removed values until the
+  // cache is within its limits
   inline void add(key_t key, value_t value) {
     value_t removed_value;
     key_t removed_key;
-    if (add(key, value, removed_key, removed_value)) {
+    bool removed = add(std::move(key), std::move(value), removed_key, removed_value);
+    while (removed) {
       value_dtor(removed_value);
+      removed = trim(removed_key, removed_value);
     }
   }
-  
+
+  // Retrieve a value based on a key, returning a pointer to the cached value or
+  // nullptr if it doesn't exist. Will move the key-value pair to the top of the
+  // list. The pointer is valid until the next call to add()
+  template<typename lookup_t>
+  inline value_t* get(const lookup_t& key) {
+    index_t i = find_node(key, _hasher(key));
+    if (i == NONE) {
+      _misses++;
+      return nullptr;
+    }
+    _hits++;
+    if (i != _head) {
+      unlink(i);
+      link_front(i);
+    }
+    return &(_nodes[i].value);
+  }
+
   // Retrieve a value based on a key, returning true if a value was found. Will
   // move the key-value pair to the top of the list
-  inline bool get(key_t key, value_t& value) {
-    cache_map_it_t it = _cache_map.find(key);
-    if (it == _cache_map.end()) {
+  template<typename lookup_t>
+  inline bool get(const lookup_t& key, value_t& value) {
+    value_t* cached = get(key);
+    if (cached == nullptr) {
       return false;
     }
-    
-    value = it->second->second;
-    _cache_list.splice(_cache_list.begin(), _cache_list, it->second);
-    
+    value = *cached;
     return true;
   }
-  
+
   // Retrieve a value based on a key without bumping the pair to the top of the
-  // list
-  inline bool steal(key_t key, value_t& value) {
-    cache_map_it_t it = _cache_map.find(key);
-    if (it == _cache_map.end()) {
-      return false;
-    }
-    
-    value = it->second->second;
-    return true;
+  // list, returning nullptr if it doesn't exist
+  template<typename lookup_t>
+  inline value_t* steal(const lookup_t& key) {
+    index_t i = find_node(key, _hasher(key));
+    return i == NONE ? nullptr : &(_nodes[i].value);
   }
-  
+
   // Check for the existence of a key-value pair
-  inline bool exist(key_t key) {
-    return _cache_map.find(key) != _cache_map.end();
+  template<typename lookup_t>
+  inline bool exist(const lookup_t& key) {
+    return find_node(key, _hasher(key)) != NONE;
   }
-  
+
   // Remove a key-value pair, destroying the value
-  inline void remove(key_t key) {
-    cache_map_it_t it = _cache_map.find(key);
-    if (it == _cache_map.end()) {
+  template<typename lookup_t>
+  inline void remove(const lookup_t& key) {
+    index_t i = find_node(key, _hasher(key));
+    if (i == NONE) {
       return;
     }
-    
-    value_dtor(it->second->second);
-    _cache_list.erase(it->second);
-    _cache_map.erase(it);
+    value_dtor(_nodes[i].value);
+    free_node(i);
   }
-  
+
   // Clear the cache, destroying all values with it
   inline void clear() {
-    for (cache_list_it_t it = _cache_list.begin(); it != _cache_list.end(); ++it) {
-      value_dtor(it->second);
+    for (index_t i = _head; i != NONE; i = _nodes[i].next) {
+      value_dtor(_nodes[i].value);
     }
-    _cache_list.clear();
-    _cache_map.clear();
+    _nodes.clear();
+    _free.clear();
+    init();
+  }
+
+  // Call fun with each key and value, from the most to the least recently used
+  template<typename fun_t>
+  inline void for_each(fun_t fun) {
+    for (index_t i = _head; i != NONE; i = _nodes[i].next) {
+      fun(_nodes[i].key, _nodes[i].value);
+    }
+  }
+
+  inline size_t size() const {
+    return _n;
+  }
+
+  // The combined cost of all values in the cache
+  inline size_t cost() const {
+    return _cost;
+  }
+
+  inline size_t max_cost() const {
+    return _max_cost;
+  }
+
+  // Recalculate the cost of a value that has grown or shrunk while in the
+  // cache, without bumping it to the top of the list. The cache isn't trimmed
+  // so trim() should be called afterwards to get back within budget
+  template<typename lookup_t>
+  inline void update_cost(const lookup_t& key) {
+    index_t i = find_node(key, _hasher(key));
+    if (i == NONE) {
+      return;
+    }
+    node_t& node = _nodes[i];
+    _cost -= node.cost;
+    node.cost = key_cost(node.key) + value_cost(node.value);
+    _cost += node.cost;
+  }
+
+  // Set the cost budget. A budget of 0 means that only the number of pairs is
+  // limited. Lowering the budget doesn't remove anything until trim() is called
+  inline void set_max_cost(size_t max_cost) {
+    _max_cost = max_cost;
+  }
+
+  // Lookup and eviction counters. Only get() counts as a lookup
+  inline size_t hits() const {
+    return _hits;
+  }
+
+  inline size_t misses() const {
+    return _misses;
+  }
+
+  inline size_t evictions() const {
+    return _evictions;
+  }
+
+  inline void reset_stats() {
+    _hits = 0;
+    _misses = 0;
+    _evictions = 0;
   }
-  
+
 private:
+  typedef uint32_t index_t;
+  static const index_t NONE = std::numeric_limits<index_t>::max();
+  static const size_t MIN_BUCKETS = 16;
+
+  struct node_t {
+    key_t key;
+    value_t value;
+    size_t hash;
+    size_t cost;
+    index_t prev;
+    index_t next;
+    index_t chain;
+  };
+
   size_t _max_size;
-  
+  size_t _max_cost;
+  size_t _cost;
+  size_t _hits;
+  size_t _misses;
+  size_t _evictions;
+  size_t _n;
+
+  hash_t _hasher;
+  equal_t _equal;
+
+  std::vector<node_t> _nodes;
+  std::vector<index_t> _free;
+  std::vector<index_t> _buckets;
+  index_t _head;
+  index_t _tail;
+
   // Should be overridden for children with value types that needs special
   // dtor handling
   inline virtual void value_dtor(value_t& value) {
     // Allow children to destroy values properly
   }
-  
-protected:
-  typedef typename std::pair<key_t, value_t> key_value_t;
-  typedef typename std::list<key_value_t> list_t;
-  typedef typename list_t::iterator cache_list_it_t;
-  typedef typename std::unordered_map<key_t, cache_list_it_t> map_t;
-  typedef typename std::unordered_map<key_t, cache_list_it_t>::iterator cache_map_it_t;
-  
-  list_t _cache_list;
-  map_t _cache_map;
+
+  // Should be overridden for children that want to be limited by cost (e.g.
+  // memory use) rather than just by number of entries. If the cost of a value
+  // changes while it is in the cache update_cost() must be called
+  inline virtual size_t value_cost(const value_t& value) {
+    return 0;
+  }
+
+  // Can be overridden alongside value_cost() for keys that take up a
+  // significant amount of memory themselves
+  inline virtual size_t key_cost(const key_t& key) {
+    return 0;
+  }
+
+  inline void init() {
+    _n = 0;
+    _cost = 0;
+    _head = NONE;
+    _tail = NONE;
+    _buckets.assign(MIN_BUCKETS, index_t(NONE));
+  }
+
+  inline size_t bucket(size_t hash) const {
+    // Fibonacci hashing so that weak hashes still spread across the buckets
+    return (size_t) (((uint64_t) hash * UINT64_C(11400714819323198485)) >> 32) & (_buckets.size() - 1);
+  }
+
+  template<typename lookup_t>
+  inline index_t find_node(const lookup_t& key, size_t hash) const {
+    for (index_t i = _buckets[bucket(hash)]; i != NONE; i = _nodes[i].chain) {
+      if (_nodes[i].hash == hash && _equal(key, _nodes[i].key)) {
+        return i;
+      }
+    }
+    return NONE;
+  }
+
+  inline index_t new_node() {
+    if (!_free.empty()) {
+      index_t i = _free.back();
+      _free.pop_back();
+      return i;
+    }
+    _nodes.push_back(node_t());
+    return _nodes.size() - 1;
+  }
+
+  // Unlinks a node and puts it up for reuse. The key and value are reset so the
+  // node doesn't hold on to their memory
+  inline void free_node(index_t i) {
+    unlink_bucket(i);
+    unlink(i);
+    _cost -= _nodes[i].cost;
+    _nodes[i].key = key_t();
+    _nodes[i].value = value_t();
+    _free.push_back(i);
+    _n--;
+  }
+
+  inline void link_front(index_t i) {
+    _nodes[i].prev = NONE;
+    _nodes[i].next = _head;
+    if (_head != NONE) {
+      _nodes[_head].prev = i;
+    }
+    _head = i;
+    if (_tail == NONE) {
+      _tail = i;
+    }
+  }
+
+  inline void unlink(index_t i) {
+    node_t& node = _nodes[i];
+    if (node.prev != NONE) {
+      _nodes[node.prev].next = node.next;
+    } else {
+      _head = node.next;
+    }
+    if (node.next != NONE) {
+      _nodes[node.next].prev = node.prev;
+    } else {
+      _tail = node.prev;
+    }
+  }
+
+  inline void link_bucket(index_t i) {
+    index_t& first = _buckets[bucket(_nodes[i].hash)];
+    _nodes[i].chain = first;
+    first = i;
+  }
+
+  inline void unlink_bucket(index_t i) {
+    index_t* link = &(_buckets[bucket(_nodes[i].hash)]);
+    while (*link != i) {
+      link = &(_nodes[*link].chain);
+    }
+    *link = _nodes[i].chain;
+  }
+
+  inline void rehash(size_t n_buckets) {
+    _buckets.assign(n_buckets, index_t(NONE));
+    for (index_t i = _tail; i != NONE; i = _nodes[i].prev) {
+      link_bucket(i);
+    }
+  }
+};
+
+// A memory budget shared by the caches of one kind that each thread keeps for
+// itself. Every live cache gets an equal share of it. The generation changes
+// whenever the budget or the number of caches does, so a cache can cheaply
+// check whether its share must be recalculated
+class SharedBudget {
+public:
+  constexpr SharedBudget(size_t bytes) :
+  _bytes(bytes),
+  _n_caches(0),
+  _generation(0) {
+
+  }
+
+  inline void add_cache() {
+    _n_caches++;
+    _generation++;
+  }
+
+  inline void remove_cache() {
+    _n_caches--;
+    _generation++;
+  }
+
+  inline size_t bytes() const {
+    return _bytes.load();
+  }
+
+  inline void set_bytes(size_t bytes) {
+    _bytes = bytes;
+    _generation++;
+  }
+
+  inline unsigned generation() const {
+    return _generation.load(std::memory_order_relaxed);
+  }
+
+  // The budget of a single cache. A budget of 0 means no limit so a share
+  // never rounds down to it
+  inline size_t share() const {
+    size_t bytes = _bytes.load();
+    int n = _n_caches.load();
+    if (bytes == 0 || n <= 1) {
+      return bytes;
+    }
+    return std::max(bytes / n, size_t(1));
+  }
+
+private:
+  std::atomic<size_t> _bytes;
+  std::atomic<int> _n_caches;
+  std::atomic<unsigned> _generation;
 };
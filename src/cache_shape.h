@@ -0,0 +1,124 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <cstddef>
+
+#include "cache_lru.h"
+
+// The output of shaping a paragraph, as stored in FreetypeShaper after
+// finish_string()
+struct ShapeResult {
+  std::vector<uint32_t> glyph_uc;
+  std::vector<unsigned int> glyph_id;
+  std::vector<unsigned int> string_id;
+  std::vector<long> x_pos;
+  std::vector<long> y_pos;
+  std::vector<long> x_mid;
+  long width;
+  long height;
+  long left_bearing;
+  long right_bearing;
+  long top_bearing;
+  long bottom_bearing;
+  long top_border;
+  long left_border;
+  long pen_x;
+  long pen_y;
+};
+
+inline size_t result_bytes(const ShapeResult& result) {
+  return sizeof(ShapeResult) +
+    result.glyph_uc.capacity() * sizeof(uint32_t) +
+    result.glyph_id.capacity() * sizeof(unsigned int) +
+    result.string_id.capacity() * sizeof(unsigned int) +
+    (result.x_pos.capacity() + result.y_pos.capacity() + result.x_mid.capacity()) * sizeof(long);
+}
+
+inline size_t result_bytes(long result) {
+  return sizeof(long);
+}
+
+// Builds a cache key by appending the raw bytes of the input. Strings are
+// zero-terminated so that consecutive strings can't run into each other
+class ResultKey {
+public:
+  ResultKey() : _key() {
+    _key.reserve(128);
+  }
+
+  inline void add(const char* string) {
+    if (string != NULL) {
+      _key.append(string);
+    }
+    _key.push_back('\0');
+  }
+
+  inline void add(int value) {
+    _key.append((const char*) &value, sizeof(int));
+  }
+
+  inline void add(double value) {
+    _key.append((const char*) &value, sizeof(double));
+  }
+
+  inline void clear() {
+    _key.clear();
+  }
+
+  inline const std::string& str() const {
+    return _key;
+  }
+
+private:
+  std::string _key;
+};
+
+// Rough per entry overhead of the cache node and the key and value headers
+static const size_t RESULT_ENTRY_OVERHEAD = 64;
+
+// LRU caches for computed results, bounded by the approximate number of bytes
+// the keys and values occupy rather than the number of entries. Each thread has
+// its own cache and they all share one budget. A result larger than the whole
+// budget stays cached only until the next one is added
+template<typename value_t>
+class ResultCache : public LRU_Cache<std::string, value_t> {
+public:
+  ResultCache(SharedBudget& budget) :
+  LRU_Cache<std::string, value_t>(std::numeric_limits<size_t>::max()),
+  _budget(budget),
+  _budget_gen(0) {
+    _budget.add_cache();
+    check_budget();
+  }
+  ~ResultCache() {
+    _budget.remove_cache();
+  }
+
+  // Apply the current share of the budget if it has changed since last checked
+  inline void check_budget() {
+    unsigned gen = _budget.generation();
+    if (gen == _budget_gen) {
+      return;
+    }
+    _budget_gen = gen;
+    this->set_max_cost(_budget.share());
+    std::string removed_key;
+    while (this->trim(removed_key)) {}
+  }
+private:
+  SharedBudget& _budget;
+  unsigned _budget_gen;
+
+  inline virtual size_t key_cost(const std::string& key) {
+    return key.size();
+  }
+  inline virtual size_t value_cost(const value_t& value) {
+    return result_bytes(value) + RESULT_ENTRY_OVERHEAD;
+  }
+};
+
+typedef ResultCache<ShapeResult> ShapeCache;
+typedef ResultCache<long> WidthCache;
@@ -0,0 +1,186 @@
+#include "cache_stats.h"
+#include "caches.h"
+#include "string_shape.h"
+#include "font_fallback.h"
+#include "types.h"
+#include "utils.h"
+
+#include <cpp11/strings.hpp>
+#include <cpp11/doubles.hpp>
+#include <cpp11/data_frame.hpp>
+#include <string>
+
+using list_w = cpp11::writable::list;
+using strings_w = cpp11::writable::strings;
+using doubles_w = cpp11::writable::doubles;
+using data_frame_w = cpp11::writable::data_frame;
+
+using namespace cpp11::literals;
+
+static const char* CACHE_NAMES[] = {
+  "face", "size", "glyph", "shape", "width", "font_location", "fallback"
+};
+static const int N_CACHES = 7;
+static const char* TIMING_NAMES[] = {
+  "new_face", "new_size", "load_glyph"
+};
+static const int N_TIMINGS = 3;
+
+// Rough memory use of a node based hash map, not counting heap memory owned by
+// the keys and values
+template<typename map_t>
+static size_t map_bytes(const map_t& map) {
+  return map.bucket_count() * sizeof(void*) +
+    map.size() * (sizeof(typename map_t::value_type) + 2 * sizeof(void*));
+}
+
+static CacheStats lookup_stats(LookupCounter& counter, size_t entries, size_t bytes) {
+  CacheStats stats = {counter.hits, counter.misses, counter.evictions, entries, bytes};
+  return stats;
+}
+
+static bool get_cache_stats(const std::string& cache, CacheStats& stats) {
+  if (cache == "face") {
+    stats = get_font_cache().face_stats();
+  } else if (cache == "size") {
+    stats = get_font_cache().size_stats();
+  } else if (cache == "glyph") {
+    stats = get_font_cache().glyph_stats();
+  } else if (cache == "shape") {
+    ShapeCache& shape_cache = get_shape_cache();
+    CacheStats res = {shape_cache.hits(), shape_cache.misses(), shape_cache.evictions(), shape_cache.size(), shape_cache.cost()};
+    stats = res;
+  } else if (cache == "width") {
+    WidthCache& width_cache = get_width_cache();
+    CacheStats res = {width_cache.hits(), width_cache.misses(), width_cache.evictions(), width_cache.size(), width_cache.cost()};
+    stats = res;
+  } else if (cache == "font_location") {
+    FontMap& font_map = get_font_map();
+    size_t bytes = map_bytes(font_map);
+    for (FontMap::iterator it = font_map.begin(); it != font_map.end(); ++it) {
+      bytes += it->first.family.capacity() + it->second.file.capacity() +
+        (it->second.axes.capacity() + it->second.coords.capacity()) * sizeof(int);
+    }
+    stats = lookup_stats(get_font_map_stats(), font_map.size(), bytes);
+  } else if (cache == "fallback") {
+    FallbackCache& fallback_cache = get_fallback_cache();
+    size_t bytes = 0;
+    fallback_cache.for_each([&](const std::string& key, const FontLoc& loc) {
+      bytes += sizeof(std::string) + sizeof(FontLoc) + key.capacity() + loc.file.capacity();
+    });
+    CacheStats res = {fallback_cache.hits(), fallback_cache.misses(), fallback_cache.evictions(), fallback_cache.size(), bytes};
+    stats = res;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool get_timing_stats(const std::string& operation, TimingStats& stats) {
+  FreetypeCache& cache = get_font_cache();
+  if (operation == "new_face") {
+    stats = cache.new_face_time;
+  } else if (operation == "new_size") {
+    stats = cache.new_size_time;
+  } else if (operation == "load_glyph") {
+    stats = cache.load_glyph_time;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void reset_cache_stats() {
+  get_font_cache().reset_stats();
+  get_shape_cache().reset_stats();
+  get_width_cache().reset_stats();
+  get_font_map_stats().reset();
+  get_fallback_cache().reset_stats();
+}
+
+int cache_stats(const char* cache, FontCacheStats* stats) {
+  BEGIN_CPP
+  CacheStats res;
+  if (!get_cache_stats(cache, res)) {
+    return 1;
+  }
+  stats->hits = res.hits;
+  stats->misses = res.misses;
+  stats->evictions = res.evictions;
+  stats->entries = res.entries;
+  stats->bytes = res.bytes;
+  END_CPP
+  return 0;
+}
+
+int timing_stats(const char* operation, FontTimingStats* stats) {
+  BEGIN_CPP
+  TimingStats res;
+  if (!get_timing_stats(operation, res)) {
+    return 1;
+  }
+  stats->calls = res.calls;
+  stats->seconds = res.nanoseconds * 1e-9;
+  END_CPP
+  return 0;
+}
+
+list_w font_cache_stats_c(bool reset) {
+  strings_w cache(N_CACHES);
+  doubles_w hits(N_CACHES);
+  doubles_w misses(N_CACHES);
+  doubles_w evictions(N_CACHES);
+  doubles_w entries(N_CACHES);
+  doubles_w bytes(N_CACHES);
+  for (int i = 0; i < N_CACHES; ++i) {
+    CacheStats stats;
+    get_cache_stats(CACHE_NAMES[i], stats);
+    cache[i] = CACHE_NAMES[i];
+    hits[i] = stats.hits;
+    misses[i] = stats.misses;
+    evictions[i] = stats.evictions;
+    entries[i] = stats.entries;
+    bytes[i] = stats.bytes;
+  }
+  data_frame_w caches({
+    "cache"_nm = cache,
+    "hits"_nm = hits,
+    "misses"_nm = misses,
+    "evictions"_nm = evictions,
+    "entries"_nm = entries,
+    "bytes"_nm = bytes
+  });
+  caches.attr("class") = {"tbl_df", "tbl", "data.frame"};
+
+  strings_w operation(N_TIMINGS);
+  doubles_w calls(N_TIMINGS);
+  doubles_w seconds(N_TIMINGS);
+  for (int i = 0; i < N_TIMINGS; ++i) {
+    TimingStats stats;
+    get_timing_stats(TIMING_NAMES[i], stats);
+    operation[i] = TIMING_NAMES[i];
+    calls[i] = stats.calls;
+    seconds[i] = stats.nanoseconds * 1e-9;
+  }
+  data_frame_w timings({
+    "operation"_nm = operation,
+    "calls"_nm = calls,
+    "seconds"_nm = seconds
+  });
+  timings.attr("class") = {"tbl_df", "tbl", "data.frame"};
+
+  if (reset) {
+    reset_cache_stats();
+  }
+
+  return list_w({
+    "caches"_nm = caches,
+    "timings"_nm = timings
+  });
+}
+
+void export_cache_stats(DllInfo* dll) {
+  R_RegisterCCallable("systemfonts", "cache_stats", (DL_FUNC)cache_stats);
+  R_RegisterCCallable("systemfonts", "timing_stats", (DL_FUNC)timing_stats);
+  R_RegisterCCallable("systemfonts", "reset_cache_stats", (DL_FUNC)reset_cache_stats);
+}
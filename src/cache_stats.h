@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cpp11/list.hpp>
+#include <R_ext/Rdynload.h>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include "types.h"
+
+// A snapshot of how a cache has behaved since its counters were last reset.
+// Entries and bytes describe the current content of the cache
+struct CacheStats {
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+  size_t entries;
+  size_t bytes;
+};
+
+// Lookup counters for the shared font location map, which may be
+// read from several threads at once
+struct LookupCounter {
+  std::atomic<size_t> hits;
+  std::atomic<size_t> misses;
+  std::atomic<size_t> evictions;
+
+  LookupCounter() : hits(0), misses(0), evictions(0) {}
+
+  inline void reset() {
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+  }
+};
+
+// Number of calls to, and total time spent in, an expensive operation
+struct TimingStats {
+  size_t calls;
+  int64_t nanoseconds;
+
+  TimingStats() : calls(0), nanoseconds(0) {}
+
+  inline void reset() {
+    calls = 0;
+    nanoseconds = 0;
+  }
+};
+
+// Adds the time between its construction and destruction to a TimingStats
+class ScopedTimer {
+public:
+  ScopedTimer(TimingStats& stats) :
+  _stats(stats),
+  _start(std::chrono::steady_clock::now()) {
+
+  }
+  ~ScopedTimer() {
+    _stats.calls++;
+    _stats.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - _start
+    ).count();
+  }
+
+private:
+  TimingStats& _stats;
+  std::chrono::steady_clock::time_point _start;
+};
+
+int cache_stats(const char* cache, FontCacheStats* stats);
+int timing_stats(const char* operation, FontTimingStats* stats);
+void reset_cache_stats();
+
+[[cpp11::register]]
+cpp11::writable::list font_cache_stats_c(bool reset);
+
+[[cpp11::init]]
+void export_cache_stats(DllInfo* dll);
@@ -1,4 +1,10 @@
 #include "caches.h"
+#include "utils.h"
+
+#include <memory>
+
+// implemented by the platform
+ResultSet *getAvailableFonts();
 
 static ResultSet* fonts;
 
@@ -12,16 +18,62 @@ ResultSet& get_local_font_list() {
   return *fonts_local;
 }
 
-static FontReg* font_registry;
+static FontIndex* fonts_local_family;
 
-FontReg& get_font_registry() {
-  return *font_registry;
+FontIndex& get_local_family_index() {
+  return *fonts_local_family;
 }
 
-static EmojiMap* emoji_map;
+static FontIndex* fonts_local_psname;
 
-EmojiMap& get_emoji_map() {
-  return *emoji_map;
+FontIndex& get_local_psname_index() {
+  return *fonts_local_psname;
+}
+
+static ResultSet* font_catalog;
+static FontIndex* font_catalog_family;
+static FontIndex* font_catalog_psname;
+static bool font_catalog_filled = false;
+
+ResultSet& get_font_catalog() {
+  if (!font_catalog_filled) {
+    std::unique_ptr<ResultSet> all_fonts(getAvailableFonts());
+    font_catalog->swap(*all_fonts);
+    for (size_t i = 0; i < font_catalog->size(); ++i) {
+      FontDescriptor* font = (*font_catalog)[i];
+      if (font->family != NULL) {
+        (*font_catalog_family)[fold_case(font->family)].push_back(i);
+      }
+      if (font->postscriptName != NULL) {
+        (*font_catalog_psname)[fold_case(font->postscriptName)].push_back(i);
+      }
+    }
+    font_catalog_filled = true;
+  }
+  return *font_catalog;
+}
+
+FontIndex& get_catalog_family_index() {
+  get_font_catalog();
+  return *font_catalog_family;
+}
+
+FontIndex& get_catalog_psname_index() {
+  get_font_catalog();
+  return *font_catalog_psname;
+}
+
+void clear_font_catalog() {
+  font_catalog->delete_all();
+  font_catalog_family->clear();
+  font_catalog_psname->clear();
+  font_catalog_filled = false;
+}
+
+static FontReg* font_registry;
+
+FontReg& get_font_registry() {
+  return *font_registry;
 }
 
 static FontMap* font_locations;
@@ -30,6 +82,17 @@ FontMap& get_font_map() {
   return *font_locations;
 }
 
+static LookupCounter font_map_stats;
+
+LookupCounter& get_font_map_stats() {
+  return font_map_stats;
+}
+
+void clear_font_map() {
+  font_map_stats.evictions += font_locations->size();
+  font_locations->clear();
+}
+
 static WinLinkMap* win_font_linking;
 
 WinLinkMap& get_win_link_map() {
@@ -39,8 +102,13 @@ WinLinkMap& get_win_link_map() {
 void init_caches(DllInfo* dll) {
   fonts = new ResultSet();
   fonts_local = new ResultSet();
+  fonts_local_family = new FontIndex();
+  fonts_local_psname = new FontIndex();
+  font_catalog = new ResultSet();
+  font_catalog_family = new FontIndex();
+  font_catalog_psname = new FontIndex();
+  font_catalog_filled = false;
   font_registry = new FontReg();
-  emoji_map = new EmojiMap();
   font_locations = new FontMap();
   win_font_linking = new WinLinkMap();
 }
@@ -48,8 +116,12 @@ void init_caches(DllInfo* dll) {
 void unload_caches(DllInfo* dll) {
   delete fonts;
   delete fonts_local;
+  delete fonts_local_family;
+  delete fonts_local_psname;
+  delete font_catalog;
+  delete font_catalog_family;
+  delete font_catalog_psname;
   delete font_registry;
-  delete emoji_map;
   delete font_locations;
   delete win_font_linking;
 }
@@ -5,19 +5,38 @@
 #include "types.h"
 #include "FontDescriptor.h"
 #include "ft_cache.h"
+#include "cache_stats.h"
 
 ResultSet& get_font_list();
 
 ResultSet& get_local_font_list();
 
+FontIndex& get_local_family_index();
+
+FontIndex& get_local_psname_index();
+
+// The fonts available on the system. They are enumerated on first use and kept
+// until clear_font_catalog() is called
+ResultSet& get_font_catalog();
+
+// The catalog fonts by case folded family and postscript name, in catalog order
+FontIndex& get_catalog_family_index();
+
+FontIndex& get_catalog_psname_index();
+
+void clear_font_catalog();
+
 FontReg& get_font_registry();
 
 FreetypeCache& get_font_cache();
 
-EmojiMap& get_emoji_map();
-
 FontMap& get_font_map();
 
+// Drops all cached font locations, e.g. after the available fonts have changed
+void clear_font_map();
+
+LookupCounter& get_font_map_stats();
+
 WinLinkMap& get_win_link_map();
 
 [[cpp11::init]]
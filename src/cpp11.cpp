@@ -5,6 +5,13 @@
 #include "cpp11/declarations.hpp"
 #include <R_ext/Visibility.h>
 
+// cache_stats.h
+cpp11::writable::list font_cache_stats_c(bool reset);
+extern "C" SEXP _systemfonts_font_cache_stats_c(SEXP reset) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(font_cache_stats_c(cpp11::as_cpp<cpp11::decay_t<bool>>(reset)));
+  END_CPP11
+}
 // dev_metrics.h
 cpp11::doubles dev_string_widths_c(cpp11::strings string, cpp11::strings family, cpp11::integers face, cpp11::doubles size, cpp11::doubles cex, cpp11::integers unit);
 extern "C" SEXP _systemfonts_dev_string_widths_c(SEXP string, SEXP family, SEXP face, SEXP size, SEXP cex, SEXP unit) {
@@ -20,18 +27,17 @@ extern "C" SEXP _systemfonts_dev_string_metrics_c(SEXP string, SEXP family, SEXP
   END_CPP11
 }
 // emoji.h
-void load_emoji_codes_c(cpp11::integers all, cpp11::integers default_text, cpp11::integers base_mod);
-extern "C" SEXP _systemfonts_load_emoji_codes_c(SEXP all, SEXP default_text, SEXP base_mod) {
+cpp11::list emoji_split_c(cpp11::strings string, cpp11::strings path, cpp11::integers index);
+extern "C" SEXP _systemfonts_emoji_split_c(SEXP string, SEXP path, SEXP index) {
   BEGIN_CPP11
-    load_emoji_codes_c(cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(all), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(default_text), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(base_mod));
-    return R_NilValue;
+    return cpp11::as_sexp(emoji_split_c(cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(string), cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(path), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(index)));
   END_CPP11
 }
 // emoji.h
-cpp11::list emoji_split_c(cpp11::strings string, cpp11::strings path, cpp11::integers index);
-extern "C" SEXP _systemfonts_emoji_split_c(SEXP string, SEXP path, SEXP index) {
+cpp11::writable::logicals has_emoji_c(cpp11::strings string);
+extern "C" SEXP _systemfonts_has_emoji_c(SEXP string) {
   BEGIN_CPP11
-    return cpp11::as_sexp(emoji_split_c(cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(string), cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(path), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(index)));
+    return cpp11::as_sexp(has_emoji_c(cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(string)));
   END_CPP11
 }
 // font_fallback.h
@@ -41,11 +47,26 @@ extern "C" SEXP _systemfonts_get_fallback_c(SEXP path, SEXP index, SEXP string,
     return cpp11::as_sexp(get_fallback_c(cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(path), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(index), cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(string), cpp11::as_cpp<cpp11::decay_t<cpp11::list_of<cpp11::list>>>(variations)));
   END_CPP11
 }
+// font_fallback.h
+cpp11::writable::data_frame font_runs_c(cpp11::strings string, cpp11::strings path, cpp11::integers index, cpp11::list_of<cpp11::list> variations);
+extern "C" SEXP _systemfonts_font_runs_c(SEXP string, SEXP path, SEXP index, SEXP variations) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(font_runs_c(cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(string), cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(path), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(index), cpp11::as_cpp<cpp11::decay_t<cpp11::list_of<cpp11::list>>>(variations)));
+  END_CPP11
+}
 // font_local.h
-int add_local_fonts(cpp11::strings paths);
-extern "C" SEXP _systemfonts_add_local_fonts(SEXP paths) {
+void defer_local_fonts_c(cpp11::strings paths, cpp11::strings index_file, bool background);
+extern "C" SEXP _systemfonts_defer_local_fonts_c(SEXP paths, SEXP index_file, SEXP background) {
   BEGIN_CPP11
-    return cpp11::as_sexp(add_local_fonts(cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(paths)));
+    defer_local_fonts_c(cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(paths), cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(index_file), cpp11::as_cpp<cpp11::decay_t<bool>>(background));
+    return R_NilValue;
+  END_CPP11
+}
+// font_local.h
+int add_local_fonts(cpp11::strings paths, cpp11::strings index_file);
+extern "C" SEXP _systemfonts_add_local_fonts(SEXP paths, SEXP index_file) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(add_local_fonts(cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(paths), cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(index_file)));
   END_CPP11
 }
 // font_local.h
@@ -85,6 +106,14 @@ extern "C" SEXP _systemfonts_reset_font_cache_c() {
     return R_NilValue;
   END_CPP11
 }
+// font_matching.h
+void set_fallback_font_c(cpp11::strings path);
+extern "C" SEXP _systemfonts_set_fallback_font_c(SEXP path) {
+  BEGIN_CPP11
+    set_fallback_font_c(cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(path));
+    return R_NilValue;
+  END_CPP11
+}
 // font_metrics.h
 cpp11::writable::data_frame get_font_info_c(cpp11::strings path, cpp11::integers index, cpp11::doubles size, cpp11::doubles res, cpp11::list_of<cpp11::list> variations);
 extern "C" SEXP _systemfonts_get_font_info_c(SEXP path, SEXP index, SEXP size, SEXP res, SEXP variations) {
@@ -164,11 +193,18 @@ extern "C" SEXP _systemfonts_fixed_to_values(SEXP fixed) {
     return cpp11::as_sexp(fixed_to_values(cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(fixed)));
   END_CPP11
 }
+// ft_cache.h
+cpp11::doubles font_cache_budget_c(double faces, double sizes);
+extern "C" SEXP _systemfonts_font_cache_budget_c(SEXP faces, SEXP sizes) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(font_cache_budget_c(cpp11::as_cpp<cpp11::decay_t<double>>(faces), cpp11::as_cpp<cpp11::decay_t<double>>(sizes)));
+  END_CPP11
+}
 // string_metrics.h
-cpp11::list get_string_shape_c(cpp11::strings string, cpp11::integers id, cpp11::strings path, cpp11::integers index, cpp11::doubles size, cpp11::doubles res, cpp11::doubles lineheight, cpp11::integers align, cpp11::doubles hjust, cpp11::doubles vjust, cpp11::doubles width, cpp11::doubles tracking, cpp11::doubles indent, cpp11::doubles hanging, cpp11::doubles space_before, cpp11::doubles space_after);
-extern "C" SEXP _systemfonts_get_string_shape_c(SEXP string, SEXP id, SEXP path, SEXP index, SEXP size, SEXP res, SEXP lineheight, SEXP align, SEXP hjust, SEXP vjust, SEXP width, SEXP tracking, SEXP indent, SEXP hanging, SEXP space_before, SEXP space_after) {
+cpp11::list get_string_shape_c(cpp11::strings string, cpp11::integers id, cpp11::strings path, cpp11::integers index, cpp11::doubles size, cpp11::doubles res, cpp11::doubles lineheight, cpp11::integers align, cpp11::doubles hjust, cpp11::doubles vjust, cpp11::doubles width, cpp11::doubles tracking, cpp11::doubles indent, cpp11::doubles hanging, cpp11::doubles space_before, cpp11::doubles space_after, int threads);
+extern "C" SEXP _systemfonts_get_string_shape_c(SEXP string, SEXP id, SEXP path, SEXP index, SEXP size, SEXP res, SEXP lineheight, SEXP align, SEXP hjust, SEXP vjust, SEXP width, SEXP tracking, SEXP indent, SEXP hanging, SEXP space_before, SEXP space_after, SEXP threads) {
   BEGIN_CPP11
-    return cpp11::as_sexp(get_string_shape_c(cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(string), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(id), cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(path), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(index), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(size), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(res), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(lineheight), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(align), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(hjust), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(vjust), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(width), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(tracking), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(indent), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(hanging), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(space_before), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(space_after)));
+    return cpp11::as_sexp(get_string_shape_c(cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(string), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(id), cpp11::as_cpp<cpp11::decay_t<cpp11::strings>>(path), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(index), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(size), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(res), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(lineheight), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(align), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(hjust), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(vjust), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(width), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(tracking), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(indent), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(hanging), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(space_before), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(space_after), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
   END_CPP11
 }
 // string_metrics.h
@@ -181,27 +217,32 @@ extern "C" SEXP _systemfonts_get_line_width_c(SEXP string, SEXP path, SEXP index
 
 extern "C" {
 static const R_CallMethodDef CallEntries[] = {
-    {"_systemfonts_add_local_fonts",      (DL_FUNC) &_systemfonts_add_local_fonts,       1},
+    {"_systemfonts_add_local_fonts",      (DL_FUNC) &_systemfonts_add_local_fonts,       2},
     {"_systemfonts_axes_to_tags",         (DL_FUNC) &_systemfonts_axes_to_tags,          1},
     {"_systemfonts_clear_local_fonts_c",  (DL_FUNC) &_systemfonts_clear_local_fonts_c,   0},
     {"_systemfonts_clear_registry_c",     (DL_FUNC) &_systemfonts_clear_registry_c,      0},
+    {"_systemfonts_defer_local_fonts_c",  (DL_FUNC) &_systemfonts_defer_local_fonts_c,   3},
     {"_systemfonts_dev_string_metrics_c", (DL_FUNC) &_systemfonts_dev_string_metrics_c,  6},
     {"_systemfonts_dev_string_widths_c",  (DL_FUNC) &_systemfonts_dev_string_widths_c,   6},
     {"_systemfonts_emoji_split_c",        (DL_FUNC) &_systemfonts_emoji_split_c,         3},
     {"_systemfonts_fixed_to_values",      (DL_FUNC) &_systemfonts_fixed_to_values,       1},
+    {"_systemfonts_font_cache_budget_c",  (DL_FUNC) &_systemfonts_font_cache_budget_c,   2},
+    {"_systemfonts_font_cache_stats_c",   (DL_FUNC) &_systemfonts_font_cache_stats_c,    1},
+    {"_systemfonts_font_runs_c",          (DL_FUNC) &_systemfonts_font_runs_c,           4},
     {"_systemfonts_get_fallback_c",       (DL_FUNC) &_systemfonts_get_fallback_c,        4},
     {"_systemfonts_get_font_info_c",      (DL_FUNC) &_systemfonts_get_font_info_c,       5},
     {"_systemfonts_get_glyph_bitmap",     (DL_FUNC) &_systemfonts_get_glyph_bitmap,      8},
     {"_systemfonts_get_glyph_info_c",     (DL_FUNC) &_systemfonts_get_glyph_info_c,      6},
     {"_systemfonts_get_glyph_outlines",   (DL_FUNC) &_systemfonts_get_glyph_outlines,    7},
     {"_systemfonts_get_line_width_c",     (DL_FUNC) &_systemfonts_get_line_width_c,      6},
-    {"_systemfonts_get_string_shape_c",   (DL_FUNC) &_systemfonts_get_string_shape_c,   16},
-    {"_systemfonts_load_emoji_codes_c",   (DL_FUNC) &_systemfonts_load_emoji_codes_c,    3},
+    {"_systemfonts_get_string_shape_c",   (DL_FUNC) &_systemfonts_get_string_shape_c,   17},
+    {"_systemfonts_has_emoji_c",          (DL_FUNC) &_systemfonts_has_emoji_c,           1},
     {"_systemfonts_locate_fonts_c",       (DL_FUNC) &_systemfonts_locate_fonts_c,        4},
     {"_systemfonts_match_font_c",         (DL_FUNC) &_systemfonts_match_font_c,          3},
     {"_systemfonts_register_font_c",      (DL_FUNC) &_systemfonts_register_font_c,       5},
     {"_systemfonts_registry_fonts_c",     (DL_FUNC) &_systemfonts_registry_fonts_c,      0},
     {"_systemfonts_reset_font_cache_c",   (DL_FUNC) &_systemfonts_reset_font_cache_c,    0},
+    {"_systemfonts_set_fallback_font_c",  (DL_FUNC) &_systemfonts_set_fallback_font_c,   1},
     {"_systemfonts_system_fonts_c",       (DL_FUNC) &_systemfonts_system_fonts_c,        0},
     {"_systemfonts_tags_to_axes",         (DL_FUNC) &_systemfonts_tags_to_axes,          1},
     {"_systemfonts_values_to_fixed",      (DL_FUNC) &_systemfonts_values_to_fixed,       1},
@@ -209,6 +250,7 @@ static const R_CallMethodDef CallEntries[] = {
 };
 }
 
+void export_cache_stats(DllInfo* dll);
 void export_cache_store(DllInfo* dll);
 void init_caches(DllInfo* dll);
 void export_emoji_detection(DllInfo* dll);
@@ -222,6 +264,7 @@ void export_string_metrics(DllInfo* dll);
 extern "C" attribute_visible void R_init_systemfonts(DllInfo* dll){
   R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
   R_useDynamicSymbols(dll, FALSE);
+  export_cache_stats(dll);
   export_cache_store(dll);
   init_caches(dll);
   export_emoji_detection(dll);
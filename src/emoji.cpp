@@ -2,8 +2,11 @@
 #include "types.h"
 #include "caches.h"
 #include "utils.h"
+#include "emoji_table.h"
 
 #include <cpp11/logicals.hpp>
+#include <algorithm>
+#include <cstring>
 
 using list_t = cpp11::list;
 using list_w = cpp11::writable::list;
@@ -16,52 +19,119 @@ using logicals_w = cpp11::writable::logicals;
 
 using namespace cpp11::literals;
 
-bool has_emoji(const char* string) {
-  UTF_UCS utf_converter;
-  int n_glyphs = 0;
-  uint32_t* codepoints = utf_converter.convert(string, n_glyphs);
-  EmojiMap& emoji_map = get_emoji_map();
-  
+static inline EmojiType emoji_type(uint32_t codepoint) {
+  if (codepoint >= EMOJI_MAX) {
+    return EmojiNone;
+  }
+  uint32_t block = emoji_block_index[codepoint >> EMOJI_BLOCK_BITS];
+  uint32_t offset = codepoint & ((1 << EMOJI_BLOCK_BITS) - 1);
+  return (EmojiType) emoji_blocks[(block << EMOJI_BLOCK_BITS) + offset];
+}
+
+// Whether a decoded string contains a codepoint that is shown as emoji
+static bool has_emoji(const uint32_t* codepoints, int n_glyphs) {
   for (int i = 0; i < n_glyphs; ++i) {
-    EmojiMap::iterator it = emoji_map.find(codepoints[i]);
-    if (it == emoji_map.end()) { // Not an emoji
-      continue;
-    }
-    switch (it->second) {
-    case 0: // Fully qualified emoji codepoint
+    switch (emoji_type(codepoints[i])) {
+    case EmojiPresentation:
       return true;
-    case 1: // Emoji with text presentation default
+    case EmojiText:
       if (i != n_glyphs - 1 && codepoints[i + 1] == 0xFE0F) {
         return true;
       }
       break;
-    case 2: // Emoji with text presentation default that can take modifier
+    case EmojiTextModifier:
       if (i != n_glyphs - 1 && codepoints[i + 1] >= 0x1F3FB && codepoints[i + 1] <= 0x1F3FF) {
         return true;
       }
       break;
+    default: // Not an emoji
+      break;
     }
   }
   
   return false;
 }
 
+// Emoji presentation starts at U+200D and the variation selector and skin tone
+// modifiers that turn text-default codepoints into emoji are above that as
+// well. In UTF-8 all of these have a lead byte of at least 0xE2, so text
+// without such a byte can't contain emoji
+static const unsigned char EMOJI_MIN_LEAD = 0xE2;
+
+// Finds the first byte at or after start that may begin an emoji codepoint, or
+// n if there is none. Eight bytes are tested at a time: clearing the high bit
+// and adding 0x1E sets it again only for bytes of 0x62 and above, which, for
+// bytes that had the high bit set, are exactly those of 0xE2 and above
+static size_t find_emoji_lead(const char* string, size_t start, size_t n) {
+  const uint64_t high_bits = UINT64_C(0x8080808080808080);
+  const uint64_t low_bits = UINT64_C(0x7F7F7F7F7F7F7F7F);
+  const uint64_t offset = UINT64_C(0x1E1E1E1E1E1E1E1E);
+  size_t i = start;
+  for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, string + i, sizeof(uint64_t));
+    if ((((word & low_bits) + offset) & word & high_bits) != 0) {
+      break;
+    }
+  }
+  for (; i < n; ++i) {
+    if ((unsigned char) string[i] >= EMOJI_MIN_LEAD) {
+      return i;
+    }
+  }
+  return n;
+}
+
+// Only the codepoints around each possible emoji codepoint are decoded, as
+// those are the only ones that can form an emoji with it
+bool has_emoji(const char* string) {
+  if (string == NULL) {
+    return false;
+  }
+  size_t n = strlen(string);
+  uint32_t codepoints[4];
+  for (size_t lead = find_emoji_lead(string, 0, n); lead < n; ) {
+    size_t from = lead;
+    if (from > 0) {
+      do {
+        --from;
+      } while (from > 0 && ((unsigned char) string[from] & 0xC0) == 0x80);
+    }
+    size_t next = std::min(n, lead + 1 + trailingBytesForUTF8[(unsigned char) string[lead]]);
+    size_t to = next < n ? std::min(n, next + 1 + trailingBytesForUTF8[(unsigned char) string[next]]) : n;
+    int n_glyphs = u8_toucs(codepoints, 4, string + from, to - from);
+    if (has_emoji(codepoints, n_glyphs)) {
+      return true;
+    }
+    lead = find_emoji_lead(string, next, n);
+  }
+  
+  return false;
+}
+
 void detect_emoji_embedding(const uint32_t* codepoints, int n, int* embedding, const char* fontpath, int index) {
-  EmojiMap& emoji_map = get_emoji_map();
+  // The font is only needed to decide on text-default emoji, so it isn't loaded
+  // until one is encountered
   FreetypeCache& cache = get_font_cache();
-  bool loaded = cache.load_font(fontpath, index, 12.0, 72.0); // We don't care about sizing
+  int loaded = -1;
+  auto font_has_glyph = [&](uint32_t codepoint) {
+    if (loaded == -1) {
+      loaded = cache.load_font(fontpath, index, 12.0, 72.0); // We don't care about sizing
+    }
+    return loaded == 1 && cache.has_glyph(codepoint);
+  };
   
   for (int i = 0; i < n; ++i) {
-    EmojiMap::iterator it = emoji_map.find(codepoints[i]);
-    if (it == emoji_map.end()) { // Not an emoji
+    EmojiType type = emoji_type(codepoints[i]);
+    if (type == EmojiNone) { // Not an emoji
       embedding[i] = 0;
       continue;
     }
-    switch (it->second) {
-    case 0: // Fully qualified emoji codepoint
+    switch (type) {
+    case EmojiPresentation:
       embedding[i] = 1;
       break;
-    case 1: // Emoji with text presentation default
+    case EmojiText:
       if (i == n - 1) {
         embedding[i] = 0;
         break;
@@ -70,13 +140,13 @@ void detect_emoji_embedding(const uint32_t* codepoints, int n, int* embedding, c
         embedding[i] = 1;
         embedding[i + 1] = 1;
         ++i;
-      } else if (loaded && cache.has_glyph(codepoints[i])) {
+      } else if (font_has_glyph(codepoints[i])) {
         embedding[i] = 0;
       } else {
         embedding[i] = 1;
       }
       break;
-    case 2: // Emoji with text presentation default that can take modifier
+    case EmojiTextModifier:
       if (i == n - 1) {
         embedding[i] = 0;
         break;
@@ -85,7 +155,7 @@ void detect_emoji_embedding(const uint32_t* codepoints, int n, int* embedding, c
         embedding[i] = 1;
         embedding[i + 1] = 1;
         ++i;
-      } else if (loaded && cache.has_glyph(codepoints[i])) {
+      } else if (font_has_glyph(codepoints[i])) {
         embedding[i] = 0;
       } else {
         embedding[i] = 1;
@@ -98,7 +168,6 @@ void detect_emoji_embedding(const uint32_t* codepoints, int n, int* embedding, c
 }
 
 bool is_emoji(uint32_t* codepoints, int n, logicals_w &result, const char* fontpath, int index) {
-  EmojiMap& emoji_map = get_emoji_map();
   FreetypeCache& cache = get_font_cache();
   bool loaded = cache.load_font(fontpath, index, 12.0, 72.0); // We don't care about sizing
   
@@ -107,16 +176,16 @@ bool is_emoji(uint32_t* codepoints, int n, logicals_w &result, const char* fontp
   }
   
   for (int i = 0; i < n; ++i) {
-    EmojiMap::iterator it = emoji_map.find(codepoints[i]);
-    if (it == emoji_map.end()) { // Not an emoji
+    EmojiType type = emoji_type(codepoints[i]);
+    if (type == EmojiNone) { // Not an emoji
       result.push_back(FALSE);
       continue;
     }
-    switch (it->second) {
-    case 0: // Fully qualified emoji codepoint
+    switch (type) {
+    case EmojiPresentation:
       result.push_back(TRUE);
       break;
-    case 1: // Emoji with text presentation default
+    case EmojiText:
       if (i == n - 1) {
         result.push_back(FALSE);
         break;
@@ -131,7 +200,7 @@ bool is_emoji(uint32_t* codepoints, int n, logicals_w &result, const char* fontp
         result.push_back(TRUE);
       }
       break;
-    case 2: // Emoji with text presentation default that can take modifier
+    case EmojiTextModifier:
       if (i == n - 1) {
         result.push_back(FALSE);
         break;
@@ -154,20 +223,6 @@ bool is_emoji(uint32_t* codepoints, int n, logicals_w &result, const char* fontp
   return true;
 }
 
-void load_emoji_codes_c(integers_t all, integers_t default_text, integers_t base_mod) {
-  EmojiMap& emoji_map = get_emoji_map();
-  
-  for (int i = 0; i < all.size(); ++i) {
-    emoji_map[all[i]] = 0;
-  }
-  for (int i = 0; i < default_text.size(); ++i) {
-    emoji_map[default_text[i]] = 1;
-  }
-  for (int i = 0; i < base_mod.size(); ++i) {
-    emoji_map[base_mod[i]] = 2;
-  }
-}
-
 list_t emoji_split_c(strings_t string, strings_t path, integers_t index) {
   int n_strings = string.size();
   bool one_path = path.size() == 1;
@@ -196,6 +251,15 @@ list_t emoji_split_c(strings_t string, strings_t path, integers_t index) {
   return list_w({(SEXP) glyph, (SEXP) id, (SEXP) emoji});
 }
 
+logicals_w has_emoji_c(strings_t string) {
+  int n_strings = string.size();
+  logicals_w result;
+  for (int i = 0; i < n_strings; ++i) {
+    result.push_back(has_emoji(Rf_translateCharUTF8(string[i])) ? TRUE : FALSE);
+  }
+  return result;
+}
+
 void export_emoji_detection(DllInfo* dll){
   R_RegisterCCallable("systemfonts", "detect_emoji_embedding", (DL_FUNC)detect_emoji_embedding);
 }
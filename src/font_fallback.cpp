@@ -1,6 +1,7 @@
 #include <vector>
 #include <cstring>
 #include <string>
+#include <algorithm>
 #include <cpp11/named_arg.hpp>
 
 #include "font_fallback.h"
@@ -9,6 +10,8 @@
 #include "cpp11/list_of.hpp"
 #include "ft_cache.h"
 #include "caches.h"
+#include "cache_shape.h"
+#include "utils.h"
 
 using namespace cpp11::literals;
 
@@ -20,13 +23,9 @@ FontDescriptor *substituteFont(char *, char *);
 FontDescriptor* findAlternativeFont(const char* familyName, const char* skipPath);
 #endif
 
-FontDescriptor *fallback_font(const char* file, int index, const char* string, const int* axes = nullptr, const int* coords = nullptr, int n_axes = 0) {
-  FreetypeCache& cache = get_font_cache();
-  if (!cache.load_font(file, index)) {
-    return NULL;
-  }
-  cache.set_axes(axes, coords, n_axes);
-
+// Looks up a fallback through the platform, checking that FreeType can load
+// it. Returns NULL if no usable fallback was found
+static FontDescriptor *substitute_font(FreetypeCache& cache, const char* string) {
   std::string font_name = cache.cur_name();
   std::vector<char> writable_name(font_name.begin(), font_name.end());
   writable_name.push_back('\0');
@@ -60,6 +59,240 @@ FontDescriptor *fallback_font(const char* file, int index, const char* string, c
   return result;
 }
 
+static const size_t FALLBACK_CACHE_MAX = 256;
+
+FallbackCache& get_fallback_cache() {
+  static thread_local FallbackCache fallback_cache(FALLBACK_CACHE_MAX);
+  return fallback_cache;
+}
+
+// The same few scripts are usually asked for again and again, so fallbacks are
+// cached per source font and variation along with the blocks of 128 codepoints
+// that the source font is missing glyphs in. A cached fallback is trusted for
+// the whole block without loading it. If the caller finds that it doesn't
+// cover the string it can ask again with refresh set, which goes to the
+// platform and replaces the cached entry. cached tells whether the result came
+// from the cache
+static bool find_fallback(const char* file, int index, const uint32_t* chars, int n_chars, const char* string, FontLoc& fallback, const int* axes, const int* coords, int n_axes, bool refresh, bool& cached) {
+  cached = false;
+  FreetypeCache& cache = get_font_cache();
+  if (!cache.load_font(file, index)) {
+    return false;
+  }
+  cache.set_axes(axes, coords, n_axes);
+
+  static thread_local std::vector<int> blocks;
+  static thread_local ResultKey key;
+  blocks.clear();
+  for (int i = 0; i < n_chars; ++i) {
+    if (!cache.has_glyph(chars[i])) {
+      blocks.push_back(chars[i] >> 7);
+    }
+  }
+  // If the font has every codepoint the blocks of the whole string are used
+  if (blocks.empty()) {
+    for (int i = 0; i < n_chars; ++i) {
+      blocks.push_back(chars[i] >> 7);
+    }
+  }
+  std::sort(blocks.begin(), blocks.end());
+  blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+  key.clear();
+  key.add((int) cache.file_id(file));
+  key.add(index);
+  key.add(n_axes);
+  for (int i = 0; i < n_axes; ++i) {
+    key.add(axes[i]);
+    key.add(coords[i]);
+  }
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    key.add(blocks[i]);
+  }
+
+  FallbackCache& fallback_cache = get_fallback_cache();
+  if (!refresh) {
+    FontLoc* cached_loc = fallback_cache.get(key.str());
+    if (cached_loc != nullptr) {
+      cached = true;
+      if (cached_loc->file.empty()) {
+        return false;
+      }
+      fallback = *cached_loc;
+      return true;
+    }
+  }
+
+  FontDescriptor* result = substitute_font(cache, string);
+  FontLoc loc;
+  if (result != NULL) {
+    loc.file = result->path;
+    loc.index = result->index;
+    delete result;
+  }
+  fallback_cache.add(key.str(), loc);
+
+  if (loc.file.empty()) {
+    return false;
+  }
+  fallback = loc;
+  return true;
+}
+
+bool fallback_font(const char* file, int index, const char* string, FontLoc& fallback, const int* axes, const int* coords, int n_axes) {
+  static thread_local UTF_UCS utf_converter;
+  int n_chars = 0;
+  uint32_t* chars = utf_converter.convert(string, n_chars);
+  bool cached;
+  return find_fallback(file, index, chars, n_chars, string, fallback, axes, coords, n_axes, false, cached);
+}
+
+// Codepoints that don't select a font of their own but take on the font of the
+// codepoint they follow (joiners and variation selectors)
+static inline bool inherits_font(uint32_t code) {
+  return (code >= 0x200C && code <= 0x200D) ||
+    (code >= 0xFE00 && code <= 0xFE0F) ||
+    (code >= 0xE0100 && code <= 0xE01EF);
+}
+
+static void append_utf8(uint32_t code, std::string& string) {
+  if (code < 0x80) {
+    string.push_back((char) code);
+  } else if (code < 0x800) {
+    string.push_back((char) (0xC0 | (code >> 6)));
+    string.push_back((char) (0x80 | (code & 0x3F)));
+  } else if (code < 0x10000) {
+    string.push_back((char) (0xE0 | (code >> 12)));
+    string.push_back((char) (0x80 | ((code >> 6) & 0x3F)));
+    string.push_back((char) (0x80 | (code & 0x3F)));
+  } else {
+    string.push_back((char) (0xF0 | (code >> 18)));
+    string.push_back((char) (0x80 | ((code >> 12) & 0x3F)));
+    string.push_back((char) (0x80 | ((code >> 6) & 0x3F)));
+    string.push_back((char) (0x80 | (code & 0x3F)));
+  }
+}
+
+// The number of fallback lookups to try for codepoints that the previous
+// fallbacks didn't cover
+static const int MAX_FALLBACK_ROUNDS = 4;
+
+// Assigns a font to each codepoint, with 0 being the primary font and higher
+// numbers indexing into fallbacks (offset by one). Every codepoint the primary
+// font doesn't have is collected and looked up in a single fallback request.
+// Whatever that font doesn't cover is collected for the next round
+static void assign_fonts(const uint32_t* string, int n, const FontSettings2& font, std::vector<int>& font_id, std::vector<FontLoc>& fallbacks) {
+  font_id.assign(n, 0);
+  FreetypeCache& cache = get_font_cache();
+  if (!cache.load_font(font.file, font.index)) {
+    return;
+  }
+  cache.set_axes(font.axes, font.coords, font.n_axes);
+
+  std::vector<int> pending;
+  for (int i = 0; i < n; ++i) {
+    if (!inherits_font(string[i]) && !cache.has_glyph(string[i])) {
+      pending.push_back(i);
+    }
+  }
+
+  std::vector<uint32_t> chars;
+  std::string utf8;
+  FontLoc fallback;
+  bool refresh = false;
+  bool cached = false;
+  for (int round = 0; round < MAX_FALLBACK_ROUNDS && !pending.empty(); ++round) {
+    chars.clear();
+    for (size_t i = 0; i < pending.size(); ++i) {
+      chars.push_back(string[pending[i]]);
+    }
+    std::sort(chars.begin(), chars.end());
+    chars.erase(std::unique(chars.begin(), chars.end()), chars.end());
+    utf8.clear();
+    for (size_t i = 0; i < chars.size(); ++i) {
+      append_utf8(chars[i], utf8);
+    }
+    if (!find_fallback(font.file, font.index, chars.data(), chars.size(), utf8.c_str(), fallback, font.axes, font.coords, font.n_axes, refresh, cached)) {
+      break;
+    }
+    if (!cache.load_font(fallback.file.c_str(), fallback.index)) {
+      break;
+    }
+    int id = 0;
+    for (size_t i = 0; i < fallbacks.size(); ++i) {
+      if (fallbacks[i].index == fallback.index && fallbacks[i].file == fallback.file) {
+        id = i + 1;
+        break;
+      }
+    }
+    if (id == 0) {
+      fallbacks.push_back(fallback);
+      id = fallbacks.size();
+    }
+    size_t n_pending = 0;
+    for (size_t i = 0; i < pending.size(); ++i) {
+      if (cache.has_glyph(string[pending[i]])) {
+        font_id[pending[i]] = id;
+      } else {
+        pending[n_pending++] = pending[i];
+      }
+    }
+    // A cached fallback may not cover all of the blocks it was found for, in
+    // which case the platform is asked again for the same codepoints
+    refresh = n_pending == pending.size() && cached;
+    if (n_pending == pending.size() && !refresh) {
+      break;
+    }
+    pending.resize(n_pending);
+  }
+
+  // Joiners and selectors follow the preceding codepoint, or the following one
+  // at the start of the string
+  int first = 0;
+  while (first < n && inherits_font(string[first])) {
+    ++first;
+  }
+  for (int i = 0; i < n; ++i) {
+    if (inherits_font(string[i])) {
+      font_id[i] = i < first ? (first < n ? font_id[first] : 0) : font_id[i - 1];
+    }
+  }
+}
+
+int font_runs(const uint32_t* string, int n, const FontSettings2& font, int* run_end, FontSettings2* run_font, int max_runs) {
+  int n_runs = 0;
+
+  BEGIN_CPP
+
+  static thread_local std::vector<int> font_id;
+  static thread_local std::vector<FontLoc> fallbacks;
+  fallbacks.clear();
+  assign_fonts(string, n, font, font_id, fallbacks);
+
+  for (int i = 0; i < n; ++i) {
+    if (i + 1 < n && font_id[i + 1] == font_id[i]) {
+      continue;
+    }
+    if (n_runs < max_runs) {
+      run_end[n_runs] = i + 1;
+      if (font_id[i] == 0) {
+        run_font[n_runs] = font;
+      } else {
+        FontSettings2 fallback = {};
+        const FontLoc& loc = fallbacks[font_id[i] - 1];
+        std::strncpy(fallback.file, loc.file.c_str(), PATH_MAX);
+        fallback.index = loc.index;
+        run_font[n_runs] = fallback;
+      }
+    }
+    n_runs++;
+  }
+
+  END_CPP
+
+  return n_runs;
+}
+
 cpp11::writable::data_frame get_fallback_c(cpp11::strings path, cpp11::integers index, cpp11::strings string, cpp11::list_of<cpp11::list> variations) {
   bool one_path = path.size() == 1;
   const char* first_path = Rf_translateCharUTF8(path[0]);
@@ -75,23 +308,24 @@ cpp11::writable::data_frame get_fallback_c(cpp11::strings path, cpp11::integers
   cpp11::writable::integers indices;
   indices.reserve(full_length);
 
+  FontLoc fallback;
   for (int i = 0; i < full_length; ++i) {
-    FontDescriptor* fallback = fallback_font(
+    bool found = fallback_font(
       one_path ? first_path : Rf_translateCharUTF8(path[i]),
       one_path ? first_index : index[i],
       one_string ? first_string : Rf_translateCharUTF8(string[i]),
+      fallback,
       INTEGER(variations[i]["axis"]),
       INTEGER(variations[i]["value"]),
       Rf_xlength(variations[i]["axis"])
     );
-    if (fallback == NULL) {
+    if (!found) {
       paths.push_back(R_NaString);
       indices.push_back(R_NaInt);
     } else {
-      paths.push_back(fallback->path);
-      indices.push_back(fallback->index);
+      paths.push_back(fallback.file.c_str());
+      indices.push_back(fallback.index);
     }
-    delete fallback;
   }
   return cpp11::writable::data_frame({
     "path"_nm = paths,
@@ -99,34 +333,86 @@ cpp11::writable::data_frame get_fallback_c(cpp11::strings path, cpp11::integers
   });
 }
 
+cpp11::writable::data_frame font_runs_c(cpp11::strings string, cpp11::strings path, cpp11::integers index, cpp11::list_of<cpp11::list> variations) {
+  cpp11::writable::integers string_id;
+  cpp11::writable::integers start;
+  cpp11::writable::integers end;
+  cpp11::writable::strings paths;
+  cpp11::writable::integers indices;
+
+  UTF_UCS utf_converter;
+  std::vector<int> font_id;
+  std::vector<FontLoc> fallbacks;
+  FontSettings2 font = {};
+
+  for (R_xlen_t i = 0; i < string.size(); ++i) {
+    int n_chars = 0;
+    uint32_t* chars = utf_converter.convert(Rf_translateCharUTF8(string[i]), n_chars);
+    std::strncpy(font.file, Rf_translateCharUTF8(path[i]), PATH_MAX);
+    font.index = index[i];
+    font.axes = INTEGER(variations[i]["axis"]);
+    font.coords = INTEGER(variations[i]["value"]);
+    font.n_axes = Rf_xlength(variations[i]["axis"]);
+    fallbacks.clear();
+    assign_fonts(chars, n_chars, font, font_id, fallbacks);
+
+    int run_start = 0;
+    for (int j = 0; j < n_chars; ++j) {
+      if (j + 1 < n_chars && font_id[j + 1] == font_id[j]) {
+        continue;
+      }
+      string_id.push_back(i + 1);
+      start.push_back(run_start + 1);
+      end.push_back(j + 1);
+      if (font_id[j] == 0) {
+        paths.push_back(font.file);
+        indices.push_back(font.index);
+      } else {
+        paths.push_back(fallbacks[font_id[j] - 1].file.c_str());
+        indices.push_back(fallbacks[font_id[j] - 1].index);
+      }
+      run_start = j + 1;
+    }
+  }
+
+  cpp11::writable::data_frame res({
+    "string"_nm = string_id,
+    "start"_nm = start,
+    "end"_nm = end,
+    "path"_nm = paths,
+    "index"_nm = indices
+  });
+  res.attr("class") = {"tbl_df", "tbl", "data.frame"};
+  return res;
+}
+
 FontSettings request_fallback(const char *string, const char *path, int index) {
-  FontDescriptor *fallback = fallback_font(path, index, string);
+  FontLoc fallback;
   FontSettings result = {};
-  if (fallback == NULL) {
+  if (!fallback_font(path, index, string, fallback)) {
     std::strncpy(result.file, path, PATH_MAX);
     result.index = index;
   } else {
-    std::strncpy(result.file, fallback->path, PATH_MAX);
-    result.index = fallback->index;
+    std::strncpy(result.file, fallback.file.c_str(), PATH_MAX);
+    result.index = fallback.index;
   }
-  delete fallback;
   return result;
 }
 
 FontSettings2 request_fallback2(const char *string, const FontSettings2& font) {
-  FontDescriptor *fallback = fallback_font(font.file, font.index, string, font.axes, font.coords, font.n_axes);
+  FontLoc fallback;
   FontSettings2 result = {};
-  if (fallback == NULL) {
+  if (!fallback_font(font.file, font.index, string, fallback, font.axes, font.coords, font.n_axes)) {
     return font;
   } else {
-    std::strncpy(result.file, fallback->path, PATH_MAX);
-    result.index = fallback->index;
+    std::strncpy(result.file, fallback.file.c_str(), PATH_MAX);
+    result.index = fallback.index;
   }
-  delete fallback;
   return result;
 }
 
 void export_font_fallback(DllInfo* dll) {
   R_RegisterCCallable("systemfonts", "get_fallback", (DL_FUNC)request_fallback);
   R_RegisterCCallable("systemfonts", "get_fallback2", (DL_FUNC)request_fallback2);
+  R_RegisterCCallable("systemfonts", "font_runs", (DL_FUNC)font_runs);
 }
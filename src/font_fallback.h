@@ -7,10 +7,31 @@
 #include <R_ext/Rdynload.h>
 
 #include "types.h"
+#include "cache_lru.h"
+
+#include <string>
+
+// Fallback fonts keyed on the source font, its variation, and the blocks of
+// codepoints in the string
+typedef LRU_Cache<std::string, FontLoc> FallbackCache;
+
+FallbackCache& get_fallback_cache();
 
 [[cpp11::register]]
 cpp11::writable::data_frame get_fallback_c(cpp11::strings path, cpp11::integers index, cpp11::strings string, cpp11::list_of<cpp11::list> variations);
 
+// Find a font that can render the string when the given font can't. Returns
+// false if no fallback could be found
+bool fallback_font(const char* file, int index, const char* string, FontLoc& fallback, const int* axes = nullptr, const int* coords = nullptr, int n_axes = 0);
+
+// Split a string into runs that can each be rendered with a single font, using
+// fallbacks for codepoints the font doesn't have. Writes the exclusive end and
+// the font of up to max_runs runs and returns the total number of runs
+int font_runs(const uint32_t* string, int n, const FontSettings2& font, int* run_end, FontSettings2* run_font, int max_runs);
+
+[[cpp11::register]]
+cpp11::writable::data_frame font_runs_c(cpp11::strings string, cpp11::strings path, cpp11::integers index, cpp11::list_of<cpp11::list> variations);
+
 FontSettings request_fallback(const char *string, const char *path, int index);
 FontSettings2 request_fallback2(const char *string, const FontSettings2& font);
 
@@ -3,10 +3,17 @@
 #include "Rinternals.h"
 #include "caches.h"
 #include "ft_cache.h"
+#include "local_index.h"
 
 #include <cpp11/strings.hpp>
 #include <string>
 #include <set>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <system_error>
 
 FontDescriptor *find_first_match(FontDescriptor *desc, ResultSet& font_list) {
   for (ResultSet::iterator it = font_list.begin(); it != font_list.end(); it++) {
@@ -18,8 +25,41 @@ FontDescriptor *find_first_match(FontDescriptor *desc, ResultSet& font_list) {
   return NULL;
 }
 
+static void index_local_font(size_t i) {
+  FontDescriptor* font = get_local_font_list()[i];
+  if (font->family != NULL) {
+    get_local_family_index()[fold_case(font->family)].push_back(i);
+  }
+  if (font->postscriptName != NULL) {
+    get_local_psname_index()[fold_case(font->postscriptName)].push_back(i);
+  }
+}
+
+// Only the fonts sharing the name are compared. They are kept in the order
+// they were added so the result is the same as scanning the full list
+static FontDescriptor *find_indexed_match(FontDescriptor *desc, FontIndex& index, const char* name) {
+  FontIndex::iterator candidates = index.find(fold_case(name));
+  if (candidates == index.end()) {
+    return NULL;
+  }
+  ResultSet& font_list = get_local_font_list();
+  for (size_t i = 0; i < candidates->second.size(); ++i) {
+    FontDescriptor* font = font_list[candidates->second[i]];
+    if ((*desc) == (*font)) {
+      return new FontDescriptor(font);
+    }
+  }
+  return NULL;
+}
+
 FontDescriptor *match_local_fonts(FontDescriptor *desc) {
-  FontDescriptor *font = find_first_match(desc, get_local_font_list());
+  complete_local_scan();
+
+  if (desc->family == NULL) {
+    return find_first_match(desc, get_local_font_list());
+  }
+
+  FontDescriptor *font = find_indexed_match(desc, get_local_family_index(), desc->family);
 
   // if we didn't find anything, try again with postscriptName as family
   if (!font) {
@@ -28,7 +68,7 @@ FontDescriptor *match_local_fonts(FontDescriptor *desc) {
     desc->postscriptName = desc->family;
     desc->family = NULL;
 
-    font = find_first_match(desc, get_local_font_list());
+    font = find_indexed_match(desc, get_local_psname_index(), desc->postscriptName);
 
     desc->family = desc->postscriptName;
     desc->postscriptName = tmp_psn;
@@ -38,7 +78,40 @@ FontDescriptor *match_local_fonts(FontDescriptor *desc) {
   return font;
 }
 
-int add_local_fonts(cpp11::strings paths) {
+// Reads all faces in a font file using the given FreeType library rather than
+// the font cache, so that it can run on any thread and doesn't push other fonts
+// out of the cache
+static void scan_font_file(FT_Library library, const std::string& path, std::vector<FontDescriptor*>& faces) {
+  FT_Face face;
+  if (FT_New_Face(library, path.c_str(), 0, &face) != 0) {
+    return;
+  }
+  int n_faces = face->num_faces;
+  for (int i = 0; i < n_faces; ++i) {
+    if (i > 0 && FT_New_Face(library, path.c_str(), i, &face) != 0) {
+      continue;
+    }
+    bool variable = false;
+    if (FT_HAS_MULTIPLE_MASTERS(face)) {
+      FT_MM_Var* variations = nullptr;
+      if (FT_Get_MM_Var(face, &variations) == 0) {
+        variable = variations->num_axis != 0;
+        FT_Done_MM_Var(library, variations);
+      }
+    }
+    faces.push_back(new FontDescriptor(face, path.c_str(), i, variable));
+    FT_Done_Face(face);
+  }
+}
+
+static const int SCAN_THREADS_MAX = 8;
+static const size_t SCAN_FILES_PER_THREAD = 16;
+
+typedef std::vector< std::vector<FontDescriptor*> > FileFaces;
+
+// Files that are already in the local font list or that appear more than once
+// are only added once
+static std::vector<std::string> new_local_files(cpp11::strings paths) {
   ResultSet& font_list = get_local_font_list();
 
   std::set<std::string> current_files;
@@ -46,39 +119,183 @@ int add_local_fonts(cpp11::strings paths) {
     current_files.insert(std::string(font_list[i]->get_path()));
   }
 
-  FreetypeCache& cache = get_font_cache();
-
+  std::vector<std::string> files;
   for (R_xlen_t i = 0; i < paths.size(); ++i) {
     std::string path(paths[i]);
-    if (current_files.find(path) != current_files.end()) {
-      continue;
+    if (current_files.insert(path).second) {
+      files.push_back(path);
     }
-    bool success = cache.load_font(path.c_str(), 0);
+  }
+  return files;
+}
+
+// Collects the faces of each file without touching R or the local font list,
+// so it can run on any thread
+static void read_local_files(const std::vector<std::string>& files, const std::string& index_path, FileFaces& faces) {
+  faces.assign(files.size(), std::vector<FontDescriptor*>());
 
-    if (!success) {
+  // Files that are unchanged since they were written to the index are taken
+  // from there. Only the remaining files are opened
+  LocalIndex index;
+  std::vector<int64_t> sizes(files.size(), -1);
+  std::vector<int64_t> mtimes(files.size(), -1);
+  std::vector<size_t> to_scan;
+  if (!index_path.empty()) {
+    index.read(index_path);
+  }
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (!index_path.empty() && local_file_stamp(files[i], sizes[i], mtimes[i]) &&
+        index.lookup(files[i], sizes[i], mtimes[i], faces[i])) {
       continue;
     }
+    to_scan.push_back(i);
+  }
 
-    font_list.push_back(new FontDescriptor(cache.get_face(), path.c_str(), 0, cache.n_axes() != 0));
-    int n_fonts = cache.get_face()->num_faces;
-    for (int i = 1; i < n_fonts; ++i) {
-      success = cache.load_font(path.c_str(), i);
-      if (!success) {
-        continue;
+  // Each worker reads whole files with its own FreeType library. The results
+  // are kept per file so they are added in the order the files were given
+  int threads = std::min(
+    (int) std::thread::hardware_concurrency(),
+    std::min(SCAN_THREADS_MAX, (int) (to_scan.size() / SCAN_FILES_PER_THREAD))
+  );
+  std::atomic<size_t> next_file(0);
+  auto scan_files = [&]() {
+    FT_Library library;
+    if (FT_Init_FreeType(&library) != 0) {
+      return;
+    }
+    for (size_t i = next_file++; i < to_scan.size(); i = next_file++) {
+      scan_font_file(library, files[to_scan[i]], faces[to_scan[i]]);
+    }
+    FT_Done_FreeType(library);
+  };
+  if (threads <= 1) {
+    scan_files();
+  } else {
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+      workers.emplace_back(scan_files);
+    }
+    for (size_t t = 0; t < workers.size(); ++t) {
+      workers[t].join();
+    }
+  }
+
+  if (!index_path.empty()) {
+    for (size_t i = 0; i < to_scan.size(); ++i) {
+      size_t file = to_scan[i];
+      if (sizes[file] >= 0) {
+        index.update(files[file], sizes[file], mtimes[file], faces[file]);
       }
-      font_list.push_back(new FontDescriptor(cache.get_face(), path.c_str(), i, cache.n_axes() != 0));
+    }
+    index.write(index_path);
+  }
+}
+
+// Moves the faces into the local font list, which takes ownership of them
+static void insert_local_faces(FileFaces& faces) {
+  ResultSet& font_list = get_local_font_list();
+  for (size_t i = 0; i < faces.size(); ++i) {
+    for (size_t j = 0; j < faces[i].size(); ++j) {
+      font_list.push_back(faces[i][j]);
+      index_local_font(font_list.size() - 1);
+    }
+  }
+  faces.clear();
+
+  clear_font_map();
+}
+
+// The local fonts found when the package is loaded are only added once they
+// are needed. Until then the files are kept here and, if requested, read on a
+// background thread
+struct PendingScan {
+  bool active;
+  std::vector<std::string> files;
+  std::string index_path;
+  FileFaces faces;
+  std::thread worker;
+
+  PendingScan() : active(false), files(), index_path(), faces(), worker() {}
+  // A scan still running when R exits must finish before the thread is
+  // destroyed
+  ~PendingScan() {
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+};
+static PendingScan pending_scan;
+
+void complete_local_scan() {
+  if (!pending_scan.active) {
+    return;
+  }
+  // Reset first as adding the faces goes through the local font list
+  pending_scan.active = false;
+  if (pending_scan.worker.joinable()) {
+    pending_scan.worker.join();
+  } else {
+    read_local_files(pending_scan.files, pending_scan.index_path, pending_scan.faces);
+  }
+  insert_local_faces(pending_scan.faces);
+  pending_scan.files.clear();
+}
+
+void defer_local_fonts_c(cpp11::strings paths, cpp11::strings index_file, bool background) {
+  complete_local_scan();
+
+  pending_scan.files = new_local_files(paths);
+  if (pending_scan.files.empty()) {
+    return;
+  }
+  pending_scan.index_path = index_file.size() == 0 ? "" : std::string(index_file[0]);
+  pending_scan.active = true;
+  if (background) {
+    try {
+      pending_scan.worker = std::thread(
+        read_local_files,
+        std::cref(pending_scan.files),
+        std::cref(pending_scan.index_path),
+        std::ref(pending_scan.faces)
+      );
+    } catch (const std::system_error&) {
+      // Without a thread the files are read on first use instead
     }
   }
+}
+
+void unload_local_fonts() {
+  if (pending_scan.worker.joinable()) {
+    pending_scan.worker.join();
+  }
+  for (size_t i = 0; i < pending_scan.faces.size(); ++i) {
+    for (size_t j = 0; j < pending_scan.faces[i].size(); ++j) {
+      delete pending_scan.faces[i][j];
+    }
+  }
+  pending_scan.faces.clear();
+  pending_scan.active = false;
+}
+
+int add_local_fonts(cpp11::strings paths, cpp11::strings index_file) {
+  // Deferred fonts were found first so they go before the new ones
+  complete_local_scan();
+
+  std::vector<std::string> files = new_local_files(paths);
+  std::string index_path = index_file.size() == 0 ? "" : std::string(index_file[0]);
 
-  FontMap& font_map = get_font_map();
-  font_map.clear();
+  FileFaces faces;
+  read_local_files(files, index_path, faces);
+  insert_local_faces(faces);
 
   return 0;
 }
 
 void clear_local_fonts_c() {
+  complete_local_scan();
   ResultSet& font_list = get_local_font_list();
-  font_list.clear();
-  FontMap& font_map = get_font_map();
-  font_map.clear();
+  font_list.delete_all();
+  get_local_family_index().clear();
+  get_local_psname_index().clear();
+  clear_font_map();
 }
@@ -9,8 +9,16 @@
 FontDescriptor *find_first_match(FontDescriptor *desc, ResultSet& font_list);
 FontDescriptor *match_local_fonts(FontDescriptor *desc);
 
+// Add the fonts passed to defer_local_fonts_c() to the local font list if that
+// hasn't happened yet. Must be called before the local font list is used
+void complete_local_scan();
+void unload_local_fonts();
+
+[[cpp11::register]]
+void defer_local_fonts_c(cpp11::strings paths, cpp11::strings index_file, bool background);
+
 [[cpp11::register]]
-int add_local_fonts(cpp11::strings paths);
+int add_local_fonts(cpp11::strings paths, cpp11::strings index_file);
 
 [[cpp11::register]]
 void clear_local_fonts_c();
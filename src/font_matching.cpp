@@ -6,11 +6,15 @@
 #include "FontDescriptor.h"
 #include "font_registry.h"
 #include "font_local.h"
+#include "font_fallback.h"
 
+#include <algorithm>
 #include <cmath>
 #include <string>
 #include <cstring>
 #include <memory>
+#include <vector>
+#include <unordered_map>
 
 #include <cpp11/integers.hpp>
 #include <cpp11/doubles.hpp>
@@ -43,6 +47,65 @@ void resetFontCache();
 static const char* cached_math_font = nullptr;
 #endif
 
+// The font used when nothing on the system matches. It is set when the package
+// is loaded so that a failed match doesn't need to call back into R
+static std::string fallback_path;
+static bool fallback_warned = false;
+
+static const std::string& get_fallback_font() {
+  if (!fallback_warned) {
+    fallback_warned = true;
+    cpp11::warning("No fonts detected on your system. Using an empty font.");
+  }
+  return fallback_path;
+}
+
+// How far a font is from the requested style. Like fontconfig, slant is
+// compared before weight and weight before width, and an axis the font can vary
+// along always matches
+static void style_distance(FontDescriptor* desc, FontDescriptor* font, int distance[3]) {
+  distance[0] = desc->italic != font->italic && !font->has_var_ital();
+  distance[1] = 0;
+  if (desc->weight != FontWeightUndefined && !font->has_var_wght()) {
+    int weight = font->weight == FontWeightUndefined ? FontWeightNormal : font->weight;
+    distance[1] = std::abs(desc->weight - weight);
+  }
+  distance[2] = 0;
+  if (desc->width != FontWidthUndefined && !font->has_var_wdth()) {
+    int width = font->width == FontWidthUndefined ? FontWidthNormal : font->width;
+    distance[2] = std::abs(desc->width - width);
+  }
+}
+
+// Picks the closest style among the catalog fonts of the requested family, or
+// the font with the family as postscript name. Families not in the catalog,
+// such as the fontconfig aliases, are left to the platform matching
+static FontDescriptor* match_catalog_font(FontDescriptor* desc) {
+  FontIndex& family_index = get_catalog_family_index();
+  ResultSet& catalog = get_font_catalog();
+  FontIndex::iterator candidates = family_index.find(fold_case(desc->family));
+  if (candidates == family_index.end()) {
+    FontIndex& psname_index = get_catalog_psname_index();
+    candidates = psname_index.find(fold_case(desc->family));
+    if (candidates == psname_index.end()) {
+      return NULL;
+    }
+    return new FontDescriptor(catalog[candidates->second[0]]);
+  }
+  FontDescriptor* best = NULL;
+  int best_distance[3];
+  int distance[3];
+  for (size_t i = 0; i < candidates->second.size(); ++i) {
+    FontDescriptor* font = catalog[candidates->second[i]];
+    style_distance(desc, font, distance);
+    if (best == NULL || std::lexicographical_compare(distance, distance + 3, best_distance, best_distance + 3)) {
+      best = font;
+      std::copy(distance, distance + 3, best_distance);
+    }
+  }
+  return new FontDescriptor(best);
+}
+
 void locate_systemfont(const char *family, int italic, int weight, int width, FontSettings2& res) {
   const char* resolved_family = family;
   if (strcmp_no_case(family, "") || strcmp_no_case(family, "sans")) {
@@ -88,6 +151,7 @@ void locate_systemfont(const char *family, int italic, int weight, int width, Fo
   key.italic = italic;
   FontMap::iterator font_it = font_map.find(key);
   if (font_it != font_map.end()) {
+    get_font_map_stats().hits++;
     strncpy(res.file, font_it->second.file.c_str(), PATH_MAX);
     res.file[PATH_MAX] = '\0';
     res.index = font_it->second.index;
@@ -96,9 +160,13 @@ void locate_systemfont(const char *family, int italic, int weight, int width, Fo
     res.n_axes = font_it->second.axes.size();
     return;
   }
+  get_font_map_stats().misses++;
 
   FontDescriptor font_desc(resolved_family, fixed_to_italic(italic), fixed_to_weight(weight), fixed_to_width(width));
   std::unique_ptr<FontDescriptor> font_loc(match_local_fonts(&font_desc));
+  if (!font_loc) {
+    font_loc = std::unique_ptr<FontDescriptor>(match_catalog_font(&font_desc));
+  }
   if (!font_loc) {
     font_loc = std::unique_ptr<FontDescriptor>(findFont(&font_desc));
   }
@@ -106,21 +174,20 @@ void locate_systemfont(const char *family, int italic, int weight, int width, Fo
   FontLoc cached_loc;
 
   if (!font_loc) {
-    list_t fallback = cpp11::as_cpp<list_t>(cpp11::package("systemfonts")["get_fallback"]());
-    cached_loc.file = std::string(Rf_translateCharUTF8(STRING_ELT(fallback[0], 0)));
-    cached_loc.index = INTEGER(fallback[1])[0];
+    cached_loc.file = get_fallback_font();
+    cached_loc.index = 0;
   } else {
     cached_loc.file = std::string(font_loc->path);
     cached_loc.index = font_loc->index;
-    if (font_loc->var_ital) {
+    if (font_loc->has_var_ital()) {
       cached_loc.axes.push_back(ITAL_TAG);
       cached_loc.coords.push_back(italic);
     }
-    if (font_loc->var_wght) {
+    if (font_loc->has_var_wght()) {
       cached_loc.axes.push_back(WGHT_TAG);
       cached_loc.coords.push_back(weight);
     }
-    if (font_loc->var_wdth) {
+    if (font_loc->has_var_wdth()) {
       cached_loc.axes.push_back(WDTH_TAG);
       cached_loc.coords.push_back(width);
     }
@@ -244,50 +311,91 @@ list_t match_font_c(strings_t family, logicals_t italic, logicals_t bold) {
   });
 }
 
+// A unique query in locate_fonts_c(). Family names are compared by their
+// CHARSXP as R keeps a single copy of each string
+struct LocateKey {
+  SEXP family;
+  double italic;
+  double weight;
+  double width;
+
+  inline bool operator==(const LocateKey &other) const {
+    return family == other.family && italic == other.italic &&
+      weight == other.weight && width == other.width;
+  }
+};
+struct LocateKeyHash {
+  size_t operator()(const LocateKey & x) const {
+    uint64_t h = hash_mix((uint64_t) (uintptr_t) x.family);
+    h = hash_mix(h ^ hash_double(x.italic));
+    h = hash_mix(h ^ hash_double(x.weight));
+    return (size_t) hash_mix(h ^ hash_double(x.width));
+  }
+};
+
 data_frame_w locate_fonts_c(strings_t family, doubles_t italic,
                             doubles_t weight, doubles_t width) {
-  strings_w paths;
-  integers_w indices;
-  list_w features;
-  list_w variations;
+  R_xlen_t n = family.size();
+  strings_w paths(n);
+  integers_w indices(n);
+  list_w features(n);
+  list_w variations(n);
+
+  // Queries typically repeat a few family/style combinations many times, so
+  // each combination is only matched once and its result reused for all rows
+  std::unordered_map<LocateKey, R_xlen_t, LocateKeyHash> unique_keys;
+  std::vector<cpp11::r_string> unique_paths;
+  std::vector<int> unique_indices;
+  std::vector<cpp11::sexp> unique_features;
+  std::vector<cpp11::sexp> unique_variations;
 
   FontSettings2 match = {};
 
-  for (R_xlen_t i = 0; i < family.size(); ++i) {
-    const char* fam = Rf_translateCharUTF8(family[i]);
-    bool standard_width = (width[i] == static_cast<double>(FontWidthUndefined) || width[i] == static_cast<double>(FontWidthNormal));
-    bool standard_weight = (weight[i] == static_cast<double>(FontWeightNormal) || weight[i] == static_cast<double>(FontWeightBold) || weight[i] == static_cast<double>(FontWeightUndefined));
-    if (!(standard_width && standard_weight && locate_in_registry(fam, italic[i], weight[i] != static_cast<double>(FontWeightNormal), match))) {
-      locate_systemfont(
-        fam,
-        italic_to_fixed(italic[i]),
-        weight_to_fixed(weight[i]),
-        width_to_fixed(width[i]),
-        match
-      );
-    }
-    paths.push_back(match.file);
-    indices.push_back(match.index);
-    strings_w tags(match.n_features);
-    integers_w vals(match.n_features);
-    for (int j = 0; j < match.n_features; ++j) {
-      tags[j] = cpp11::r_string({
-        match.features[j].feature[0],
-        match.features[j].feature[1],
-        match.features[j].feature[2],
-        match.features[j].feature[3]
+  for (R_xlen_t i = 0; i < n; ++i) {
+    LocateKey key = {STRING_ELT(family, i), italic[i], weight[i], width[i]};
+    auto cached = unique_keys.find(key);
+    if (cached == unique_keys.end()) {
+      const char* fam = Rf_translateCharUTF8(family[i]);
+      bool standard_width = (width[i] == static_cast<double>(FontWidthUndefined) || width[i] == static_cast<double>(FontWidthNormal));
+      bool standard_weight = (weight[i] == static_cast<double>(FontWeightNormal) || weight[i] == static_cast<double>(FontWeightBold) || weight[i] == static_cast<double>(FontWeightUndefined));
+      if (!(standard_width && standard_weight && locate_in_registry(fam, italic[i], weight[i] != static_cast<double>(FontWeightNormal), match))) {
+        locate_systemfont(
+          fam,
+          italic_to_fixed(italic[i]),
+          weight_to_fixed(weight[i]),
+          width_to_fixed(width[i]),
+          match
+        );
+      }
+      unique_paths.push_back(cpp11::r_string(match.file));
+      unique_indices.push_back(match.index);
+      strings_w tags(match.n_features);
+      integers_w vals(match.n_features);
+      for (int j = 0; j < match.n_features; ++j) {
+        tags[j] = cpp11::r_string({
+          match.features[j].feature[0],
+          match.features[j].feature[1],
+          match.features[j].feature[2],
+          match.features[j].feature[3]
+        });
+        vals[j] = match.features[j].setting;
+      }
+      list_w f_feat({tags, vals});
+      f_feat.attr("class") = {"font_feature"};
+      unique_features.push_back(f_feat);
+      list_w f_vars({
+        "axis"_nm = integers_w(match.axes, match.axes + match.n_axes),
+        "value"_nm = integers_w(match.coords, match.coords + match.n_axes)
       });
-      vals[j] = match.features[j].setting;
+      f_vars.attr("class") = {"font_variation"};
+      unique_variations.push_back(f_vars);
+      cached = unique_keys.emplace(key, unique_indices.size() - 1).first;
     }
-    list_w f_feat({tags, vals});
-    f_feat.attr("class") = {"font_feature"};
-    features.push_back(f_feat);
-    list_w f_vars({
-      "axis"_nm = integers_w(match.axes, match.axes + match.n_axes),
-      "value"_nm = integers_w(match.coords, match.coords + match.n_axes)
-    });
-    f_vars.attr("class") = {"font_variation"};
-    variations.push_back(f_vars);
+    R_xlen_t u = cached->second;
+    paths[i] = unique_paths[u];
+    indices[i] = unique_indices[u];
+    features[i] = unique_features[u];
+    variations[i] = unique_variations[u];
   }
 
   data_frame_w res({
@@ -302,11 +410,10 @@ data_frame_w locate_fonts_c(strings_t family, doubles_t italic,
 }
 
 data_frame_w system_fonts_c() {
-  int n = 0;
-
-  std::unique_ptr<ResultSet> all_fonts(getAvailableFonts());
-  all_fonts->insert(all_fonts->begin(), get_local_font_list().begin(), get_local_font_list().end());
-  n = all_fonts->n_fonts();
+  // Local fonts are listed first, followed by the system fonts
+  complete_local_scan();
+  ResultSet* font_lists[] = {&get_local_font_list(), &get_font_catalog()};
+  int n = font_lists[0]->n_fonts() + font_lists[1]->n_fonts();
 
   strings_w path(n);
   integers_w index(n);
@@ -345,29 +452,28 @@ data_frame_w system_fonts_c() {
 
   int i = 0;
 
-  for (ResultSet::iterator it = all_fonts->begin(); it != all_fonts->end(); it++) {
-    path[i] = (*it)->get_path();
-    index[i] = (*it)->index;
-    name[i] = (*it)->get_psname();
-    family[i] = (*it)->get_family();
-    style[i] = (*it)->get_style();
-    weight[i] = (*it)->get_weight();
-    if (weight[i] == 0) {
-      weight[i] = NA_INTEGER;
-    }
-    width[i] = (*it)->get_width();
-    if (width[i] == 0) {
-      width[i] = NA_INTEGER;
+  for (ResultSet* font_list : font_lists) {
+    for (ResultSet::iterator it = font_list->begin(); it != font_list->end(); it++) {
+      path[i] = (*it)->get_path();
+      index[i] = (*it)->index;
+      name[i] = (*it)->get_psname();
+      family[i] = (*it)->get_family();
+      style[i] = (*it)->get_style();
+      weight[i] = (*it)->get_weight();
+      if (weight[i] == 0) {
+        weight[i] = NA_INTEGER;
+      }
+      width[i] = (*it)->get_width();
+      if (width[i] == 0) {
+        width[i] = NA_INTEGER;
+      }
+      italic[i] = (Rboolean) (*it)->italic;
+      monospace[i] = (Rboolean) (*it)->monospace;
+      variable[i] = (Rboolean) (*it)->variable;
+      ++i;
     }
-    italic[i] = (Rboolean) (*it)->italic;
-    monospace[i] = (Rboolean) (*it)->monospace;
-    variable[i] = (Rboolean) (*it)->variable;
-    ++i;
   }
 
-  // Remove local fonts so they don't get deleted at cleanup
-  all_fonts->erase(all_fonts->begin(), all_fonts->begin() + get_local_font_list().size());
-
   data_frame_w res({
     "path"_nm = path,
     "index"_nm = index,
@@ -386,12 +492,19 @@ data_frame_w system_fonts_c() {
 
 void reset_font_cache_c() {
   resetFontCache();
-  get_font_map().clear();
+  clear_font_catalog();
+  clear_font_file_axes();
+  get_fallback_cache().clear();
+  clear_font_map();
 #if !defined _WIN32 && !defined __APPLE__
   cached_math_font = nullptr;
 #endif
 }
 
+void set_fallback_font_c(strings_t path) {
+  fallback_path = std::string(path[0]);
+}
+
 void export_font_matching(DllInfo* dll) {
   R_RegisterCCallable("systemfonts", "locate_font", (DL_FUNC)locate_font);
   R_RegisterCCallable("systemfonts", "locate_font_with_features", (DL_FUNC)locate_font_with_features);
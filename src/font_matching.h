@@ -54,5 +54,8 @@ cpp11::writable::data_frame system_fonts_c();
 [[cpp11::register]]
 void reset_font_cache_c();
 
+[[cpp11::register]]
+void set_fallback_font_c(cpp11::strings path);
+
 [[cpp11::init]]
 void export_font_matching(DllInfo* dll);
@@ -243,7 +243,7 @@ data_frame_w get_glyph_info_c(strings_t glyphs, strings_t path, integers_t index
     }
 
     glyph_ids[i] = glyph_info.index;
-    glyph_name[i] = glyph_info.name;
+    glyph_name[i] = cache.glyph_name(glyph_info.index);
     widths[i] = glyph_info.width / 64.0;
     heights[i] = glyph_info.height / 64.0;
     x_bearings[i] = glyph_info.x_bearing / 64.0;
@@ -35,15 +35,13 @@ void register_font_c(strings_t family, strings_t paths, integers_t indices, stri
   }
   registry[name] = col;
 
-  FontMap& font_map = get_font_map();
-  font_map.clear();
+  clear_font_map();
 }
 
 void clear_registry_c() {
   FontReg& registry = get_font_registry();
   registry.clear();
-  FontMap& font_map = get_font_map();
-  font_map.clear();
+  clear_font_map();
 }
 
 data_frame_w registry_fonts_c() {
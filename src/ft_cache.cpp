@@ -2,6 +2,7 @@
 #include "FontDescriptor.h"
 #include "R_ext/Print.h"
 #include "utils.h"
+#include "cache_file.h"
 #include <cmath>
 #include <cstdint>
 #include <cpp11/protect.hpp>
@@ -11,13 +12,183 @@
 #include <string>
 #include <vector>
 #include <cstring>
+#include <mutex>
+#include <unordered_set>
+#include <unordered_map>
+#include <deque>
+#include <algorithm>
+#include FT_TRUETYPE_TAGS_H
+
+// FNV-1a hash of a file path
+static uint64_t hash_path(const char* path) {
+  uint64_t hash = UINT64_C(14695981039346656037);
+  for (const unsigned char* c = (const unsigned char*) path; *c != '\0'; ++c) {
+    hash ^= *c;
+    hash *= UINT64_C(1099511628211);
+  }
+  return hash;
+}
+
+// Paths are looked up by their hash so finding an already interned path
+// doesn't allocate. The deque keeps the stored paths in place as it grows. Id 0
+// is reserved for "no file". Alongside the path we remember which of the
+// registered axes the file has, once someone has asked
+struct FileInterner {
+  std::mutex mutex;
+  std::unordered_multimap<uint64_t, FileID> ids;
+  std::deque<std::string> paths;
+  std::deque<unsigned char> axes;
+
+  FileInterner() : mutex(), ids(), paths(1, std::string()), axes(1, 0) {}
+};
+
+static const unsigned char AXES_KNOWN = 1;
+static const unsigned char AXES_WGHT = 2;
+static const unsigned char AXES_WDTH = 4;
+static const unsigned char AXES_ITAL = 8;
+
+static FileInterner& get_file_interner() {
+  // Never destroyed as threads may outlive the package
+  static FileInterner* interner = new FileInterner();
+  return *interner;
+}
+
+FileID intern_font_file(const char* path) {
+  uint64_t hash = hash_path(path);
+  FileInterner& interner = get_file_interner();
+  std::lock_guard<std::mutex> lock(interner.mutex);
+  auto range = interner.ids.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (interner.paths[it->second] == path) {
+      return it->second;
+    }
+  }
+  FileID id = interner.paths.size();
+  interner.paths.push_back(path);
+  interner.axes.push_back(0);
+  interner.ids.emplace(hash, id);
+  return id;
+}
+
+const char* font_file_path(FileID id) {
+  FileInterner& interner = get_file_interner();
+  std::lock_guard<std::mutex> lock(interner.mutex);
+  if (id >= interner.paths.size()) {
+    return "";
+  }
+  return interner.paths[id].c_str();
+}
+
+// Opens the first face in the file with a private FreeType library so that
+// the font cache of the calling thread, and the font currently set in it, is
+// left alone
+static void read_file_axes(const char* path, bool& weight, bool& width, bool& italic) {
+  weight = false;
+  width = false;
+  italic = false;
+  FT_Library library;
+  if (FT_Init_FreeType(&library) != 0) {
+    return;
+  }
+  FT_Face face;
+  if (FT_New_Face(library, path, 0, &face) == 0) {
+    FT_MM_Var* variations = nullptr;
+    if (FT_HAS_MULTIPLE_MASTERS(face) && FT_Get_MM_Var(face, &variations) == 0) {
+      for (FT_UInt i = 0; i < variations->num_axis; ++i) {
+        long tag = variations->axis[i].tag;
+        if (tag == WGHT_TAG) weight = true;
+        else if (tag == WDTH_TAG) width = true;
+        else if (tag == ITAL_TAG) italic = true;
+      }
+      FT_Done_MM_Var(library, variations);
+    }
+    FT_Done_Face(face);
+  }
+  FT_Done_FreeType(library);
+}
+
+void font_file_axes(FileID id, bool& weight, bool& width, bool& italic) {
+  FileInterner& interner = get_file_interner();
+  unsigned char axes = 0;
+  {
+    std::lock_guard<std::mutex> lock(interner.mutex);
+    if (id < interner.axes.size()) {
+      axes = interner.axes[id];
+    }
+  }
+  if (!(axes & AXES_KNOWN)) {
+    // The lock is released while the font is opened
+    weight = false;
+    width = false;
+    italic = false;
+    if (id != 0) {
+      read_file_axes(font_file_path(id), weight, width, italic);
+    }
+    axes = AXES_KNOWN |
+      (weight ? AXES_WGHT : 0) |
+      (width ? AXES_WDTH : 0) |
+      (italic ? AXES_ITAL : 0);
+    std::lock_guard<std::mutex> lock(interner.mutex);
+    if (id < interner.axes.size()) {
+      interner.axes[id] = axes;
+    }
+  }
+  weight = axes & AXES_WGHT;
+  width = axes & AXES_WDTH;
+  italic = axes & AXES_ITAL;
+}
+
+void clear_font_file_axes() {
+  FileInterner& interner = get_file_interner();
+  std::lock_guard<std::mutex> lock(interner.mutex);
+  std::fill(interner.axes.begin(), interner.axes.end(), 0);
+}
+
+// Faces and sizes are limited by the (approximate) memory they hold on to. The
+// entry caps are only there to keep the cache lookups cheap
+static const size_t FACE_CACHE_MAX = 256;
+static const size_t SIZE_CACHE_MAX = 512;
+static SharedBudget face_budget(128 * 1024 * 1024);
+static SharedBudget size_budget(16 * 1024 * 1024);
+
+// FreeType doesn't report how much memory it allocates so the costs are
+// estimates. A face is charged its record along with its share of the font
+// file it reads from. Faces from a collection share one mapping of the file so
+// each is charged an equal part of it, adding up to the file once when all of
+// them are cached. A size is charged the state of the bytecode interpreter
+// (storage, stack, twilight zone, and scaled cvt) as given by the maxp table.
+// The glyph metrics and kerning cached with a size are added to its cost as
+// they grow (see update_size_cost())
+static size_t face_cost(FT_Face face) {
+  size_t cost = sizeof(FT_FaceRec);
+  if (face->stream == nullptr) {
+    return cost;
+  }
+  size_t n_faces = face->num_faces > 1 ? face->num_faces : 1;
+  return cost + face->stream->size / n_faces;
+}
+static size_t size_cost(FT_Face face) {
+  size_t cost = sizeof(FT_SizeRec) + sizeof(SizeStore);
+  TT_MaxProfile* maxp = (TT_MaxProfile*) FT_Get_Sfnt_Table(face, FT_SFNT_MAXP);
+  if (maxp == nullptr) {
+    return cost;
+  }
+  cost += (maxp->maxStorage + maxp->maxStackElements) * sizeof(FT_Long);
+  cost += (maxp->maxTwilightPoints + 4) * (2 * sizeof(FT_Vector) + 1);
+  cost += (maxp->maxFunctionDefs + maxp->maxInstructionDefs) * 4 * sizeof(FT_Long);
+  FT_ULong cvt_length = 0;
+  if (FT_Load_Sfnt_Table(face, TTAG_cvt, 0, nullptr, &cvt_length) == 0) {
+    cost += (cvt_length / 2) * sizeof(FT_F26Dot6);
+  }
+  return cost;
+}
 
 FreetypeCache::FreetypeCache()
   : error_code(0),
-    glyphstore(),
-    face_cache(16),
-    size_cache(32),
+    face_cache(FACE_CACHE_MAX),
+    size_cache(SIZE_CACHE_MAX),
     cur_id(),
+    cur_path(""),
     cur_var(0),
     cur_size(-1),
     cur_res(-1),
@@ -25,111 +196,191 @@ FreetypeCache::FreetypeCache()
     cur_glyph(0),
     cur_has_variations(false),
     face(nullptr),
-    size(nullptr)
+    size(nullptr),
+    size_store(nullptr),
+    glyphstore(nullptr),
+    kernstore(nullptr),
+    glyph_hits(0),
+    glyph_misses(0),
+    face_budget_gen(0),
+    size_budget_gen(0)
   {
+  face_budget.add_cache();
+  size_budget.add_cache();
+  face_budget_gen = face_budget.generation();
+  size_budget_gen = size_budget.generation();
+  face_cache.set_max_cost(face_budget.share());
+  size_cache.set_max_cost(size_budget.share());
+
+  // Caches may be created on worker threads so a failure can't be raised as an
+  // R error here. It is instead reported through error_code when a font is
+  // loaded
   FT_Error err = FT_Init_FreeType(&library);
   if (err != 0) {
-    cpp11::stop("systemfonts failed to initialise the freetype font cache");
+    library = nullptr;
+    error_code = err;
   }
 }
 FreetypeCache::~FreetypeCache() {
-  FT_Done_FreeType(library);
+  size_cache.clear();
+  face_cache.clear();
+  face_budget.remove_cache();
+  size_budget.remove_cache();
+  if (library != nullptr) {
+    FT_Done_FreeType(library);
+  }
 }
 
 bool FreetypeCache::load_font(const char* file, int index, double size, double res) {
-  FaceID id(std::string(file), index);
+  return load_font(file_id(file), index, size, res);
+}
+
+bool FreetypeCache::load_font(const char* file, int index) {
+  return load_font(file_id(file), index);
+}
+
+bool FreetypeCache::load_font(FileID file, int index, double size, double res) {
+  FaceID id(file, index);
 
   if (current_face(id, size, res)) {
     return true;
   }
+  check_budget();
 
-  if (!load_face(id)) {
-    return false;
-  }
-
-  if (!load_size(id, size, res)) {
+  if (!load_face(id) || !load_size(id, size, res)) {
+    reset_current();
     return false;
   }
 
-  cur_id = id;
-  cur_var = 0;
+  set_current(id);
   cur_size = size;
   cur_res = res;
-  glyphstore.clear();
 
   cur_can_kern = FT_HAS_KERNING(face);
   cur_has_variations = is_variable();
+  set_glyphstore();
 
   return true;
 }
 
-bool FreetypeCache::load_font(const char* file, int index) {
-  std::string file_str(file);
-  FaceID id(file_str, index);
+bool FreetypeCache::load_font(FileID file, int index) {
+  FaceID id(file, index);
 
   if (id == cur_id) {
     return true;
   }
+  check_budget();
 
   if (!load_face(id)) {
+    reset_current();
     return false;
   }
 
-  cur_id = id;
-  cur_var = 0;
+  set_current(id);
   cur_size = -1;
   cur_res = -1;
-  glyphstore.clear();
+  size_store = nullptr;
+  set_glyphstore();
 
   cur_can_kern = FT_HAS_KERNING(face);
 
   return true;
 }
 
+// Most calls are for the current font so it is checked before going to the
+// interner
+FileID FreetypeCache::file_id(const char* file) {
+  if (cur_id.file != 0 && strcmp(file, cur_path) == 0) {
+    return cur_id.file;
+  }
+  return intern_font_file(file);
+}
+
+void FreetypeCache::set_current(FaceID id) {
+  if (id.file != cur_id.file) {
+    cur_path = font_file_path(id.file);
+  }
+  cur_id = id;
+}
+
+// A failed load may have left another face active, and may have evicted the
+// current one, so nothing can be considered current afterwards
+void FreetypeCache::reset_current() {
+  cur_id = FaceID();
+  cur_path = "";
+  cur_size = -1;
+  cur_res = -1;
+  size_store = nullptr;
+  set_glyphstore();
+}
+
 bool FreetypeCache::load_face(FaceID face) {
   if (face == cur_id) {
     return true;
   }
 
-  FaceStore cached_face;
-  if (face_cache.get(face, cached_face)) {
-    this->face = cached_face.face;
+  FaceStore* cached = face_cache.get(face);
+  if (cached != nullptr) {
+    this->face = cached->face;
+    cur_var = cached->var;
     cur_is_scalable = FT_IS_SCALABLE(this->face);
     return true;
   }
+  if (library == nullptr) {
+    error_code = FT_Err_Invalid_Library_Handle;
+    this->face = nullptr;
+    return false;
+  }
+  const char* file = font_file_path(face.file);
   FT_Face new_face;
-  FT_Error err = FT_New_Face(this->library, face.file.c_str(), face.index, &new_face);
-  if (err != 0) {
-    error_code = err;
-    err = FT_New_Face(this->library, face.file.c_str(), 0, &new_face);
+  FT_Error err;
+  {
+    ScopedTimer timer(new_face_time);
+    err = open_mapped_face(this->library, file, face.index, &new_face);
     if (err != 0) {
-      this->face = nullptr;
-      return false;
+      error_code = err;
+      err = open_mapped_face(this->library, file, 0, &new_face);
     }
   }
+  if (err != 0) {
+    this->face = nullptr;
+    return false;
+  }
   this->face = new_face;
+  cur_var = 0;
   cur_is_scalable = FT_IS_SCALABLE(new_face);
-  if (face_cache.add(face, FaceStore(new_face), cached_face)) {
-    for(std::unordered_set<SizeID>::iterator it = cached_face.sizes.begin(); it != cached_face.sizes.end(); ++it) {
-      size_cache.remove(*it);
-    }
-    FT_Done_Face(cached_face.face);
+  FaceID removed_id;
+  FaceStore cached_face;
+  if (face_cache.add(face, FaceStore(new_face, face_cost(new_face)), removed_id, cached_face)) {
+    do {
+      release_face(cached_face);
+    } while (face_cache.trim(removed_id, cached_face));
   }
   return true;
 }
 
+void FreetypeCache::release_face(FaceStore& face) {
+  for(std::unordered_set<SizeID>::iterator it = face.sizes.begin(); it != face.sizes.end(); ++it) {
+    size_cache.remove(*it);
+  }
+  FT_Done_Face(face.face);
+}
+
 bool FreetypeCache::load_size(FaceID face, double size, double res) {
   SizeID id(face, size, res);
-  FT_Size cached_size;
-  SizeID cached_id;
-  FaceStore cached_face;
-  if (size_cache.get(id, cached_size)) {
-    FT_Activate_Size(cached_size);
-    this->size = cached_size;
+  SizeStore** cached_size = size_cache.get(id);
+  if (cached_size != nullptr) {
+    FT_Activate_Size((*cached_size)->size);
+    this->size = (*cached_size)->size;
+    this->size_store = *cached_size;
     return true;
   }
   FT_Size new_size;
-  FT_Error err = FT_New_Size(this->face, &new_size);
+  FT_Error err;
+  {
+    ScopedTimer timer(new_size_time);
+    err = FT_New_Size(this->face, &new_size);
+  }
   if (err != 0) {
     error_code = err;
     return false;
@@ -179,18 +430,84 @@ bool FreetypeCache::load_size(FaceID face, double size, double res) {
     }
     unscaled_scaling = 1;
   }
-  if (size_cache.add(id, new_size, cached_id)) {
-    if (face_cache.get(cached_id.face, cached_face)) {
-      cached_face.sizes.erase(cached_id);
-    }
-  }
-
+  SizeID cached_id;
+  SizeStore* new_store = new SizeStore(new_size, size_cost(this->face));
   face_cache.add_size_id(face, id);
+  if (size_cache.add(id, new_store, cached_id)) {
+    do {
+      face_cache.remove_size_id(cached_id.face, cached_id);
+    } while (size_cache.trim(cached_id));
+  }
 
   this->size = new_size;
+  this->size_store = new_store;
   return true;
 }
 
+// The most recently used face and size are never evicted so lowering the
+// budget can't invalidate the current font
+void FreetypeCache::set_budget(size_t face_bytes, size_t size_bytes) {
+  FaceID removed_face;
+  FaceStore cached_face;
+  face_cache.set_max_cost(face_bytes);
+  while (face_cache.trim(removed_face, cached_face)) {
+    release_face(cached_face);
+  }
+  SizeID removed_size;
+  size_cache.set_max_cost(size_bytes);
+  while (size_cache.trim(removed_size)) {
+    face_cache.remove_size_id(removed_size.face, removed_size);
+  }
+}
+
+// Every thread's cache gets an equal share of the budgets. The share changes
+// when the budgets are set or when threads create or free their caches, and is
+// picked up the next time the cache loads a font that isn't current
+void FreetypeCache::check_budget() {
+  unsigned face_gen = face_budget.generation();
+  unsigned size_gen = size_budget.generation();
+  if (face_gen == face_budget_gen && size_gen == size_budget_gen) {
+    return;
+  }
+  face_budget_gen = face_gen;
+  size_budget_gen = size_gen;
+  set_budget(face_budget.share(), size_budget.share());
+}
+
+CacheStats FreetypeCache::face_stats() {
+  CacheStats stats = {
+    face_cache.hits(), face_cache.misses(), face_cache.evictions(),
+    face_cache.size(), face_cache.cost()
+  };
+  return stats;
+}
+
+CacheStats FreetypeCache::size_stats() {
+  CacheStats stats = {
+    size_cache.hits(), size_cache.misses(), size_cache.evictions(),
+    size_cache.size(), size_cache.cost()
+  };
+  return stats;
+}
+
+// Glyph metrics are dropped along with their size so they are never evicted on
+// their own
+CacheStats FreetypeCache::glyph_stats() {
+  CacheStats stats = {glyph_hits, glyph_misses, 0, 0, 0};
+  size_cache.glyph_usage(stats.entries, stats.bytes);
+  return stats;
+}
+
+void FreetypeCache::reset_stats() {
+  face_cache.reset_stats();
+  size_cache.reset_stats();
+  glyph_hits = 0;
+  glyph_misses = 0;
+  new_face_time.reset();
+  new_size_time.reset();
+  load_glyph_time.reset();
+}
+
 bool FreetypeCache::has_glyph(uint32_t index) {
   FT_UInt glyph_id = FT_Get_Char_Index(face, index);
   return glyph_id != 0;
@@ -203,7 +520,10 @@ bool FreetypeCache::load_unicode(uint32_t index) {
 
 bool FreetypeCache::load_glyph(FT_UInt id, int flags) {
   FT_Error err = 0;
-  err = FT_Load_Glyph(face, id, flags);
+  {
+    ScopedTimer timer(load_glyph_time);
+    err = FT_Load_Glyph(face, id, flags);
+  }
   error_code = err;
   if (err == 0) {
     cur_glyph = id;
@@ -297,7 +617,6 @@ FontFaceInfo FreetypeCache::font_info() {
 }
 
 GlyphInfo FreetypeCache::glyph_info() {
-  static char name_buffer[50];
   GlyphInfo res = {};
 
   res.index = cur_glyph;
@@ -314,8 +633,10 @@ GlyphInfo FreetypeCache::glyph_info() {
     res.y_bearing = face->glyph->metrics.horiBearingY;
   }
 
-  res.bbox = {res.x_bearing, res.x_bearing + res.width,
-              res.y_bearing - res.height, res.y_bearing};
+  res.bbox[0] = res.x_bearing;
+  res.bbox[1] = res.x_bearing + res.width;
+  res.bbox[2] = res.y_bearing - res.height;
+  res.bbox[3] = res.y_bearing;
 
   if (!cur_is_scalable) {
 
@@ -331,30 +652,46 @@ GlyphInfo FreetypeCache::glyph_info() {
     res.bbox[3] *= unscaled_scaling;
   }
 
-  if (FT_HAS_GLYPH_NAMES(face)) {
-    FT_Get_Glyph_Name(face, cur_glyph, name_buffer, 50);
-    res.name = std::string(name_buffer);
-  } else {
-    res.name = "";
-  }
-
   return res;
 }
 
+std::string FreetypeCache::glyph_name(FT_UInt index) {
+  char name_buffer[50];
+
+  if (!FT_HAS_GLYPH_NAMES(face) || FT_Get_Glyph_Name(face, index, name_buffer, 50) != 0) {
+    return "";
+  }
+  return std::string(name_buffer);
+}
+
 GlyphInfo FreetypeCache::cached_glyph_info(uint32_t index, int& error) {
-  std::map<uint32_t, GlyphInfo>::iterator cached_gi = glyphstore.find(index);
   GlyphInfo info = {};
   error = 0;
 
-  if (cached_gi == glyphstore.end()) {
+  if (glyphstore == nullptr) {
+    glyph_misses++;
     if (load_unicode(index)) {
       info = glyph_info();
-      glyphstore[index] = info;
     } else {
       error = error_code;
     }
+    return info;
+  }
+
+  if (glyphstore->get(index, info)) {
+    glyph_hits++;
   } else {
-    info = cached_gi->second;
+    glyph_misses++;
+    if (load_unicode(index)) {
+      info = glyph_info();
+      size_t bytes = glyphstore->bytes();
+      glyphstore->add(index, info);
+      if (glyphstore->bytes() != bytes) {
+        update_size_cost();
+      }
+    } else {
+      error = error_code;
+    }
   }
 
   return info;
@@ -372,14 +709,20 @@ long FreetypeCache::cur_descender() {
 bool FreetypeCache::cur_is_variable() {
   return cur_has_variations;
 }
-bool FreetypeCache::get_kerning(uint32_t left, uint32_t right, long &x, long &y) {
+// Kerning is looked up based on glyph ids (as given by the index field of
+// GlyphInfo), not unicode codepoints
+bool FreetypeCache::get_kerning(FT_UInt left_id, FT_UInt right_id, long &x, long &y) {
   x = 0;
   y = 0;
   // Early exit
   if (!cur_can_kern) return true;
 
-  FT_UInt left_id = FT_Get_Char_Index(face, left);
-  FT_UInt right_id = FT_Get_Char_Index(face, right);
+  KerningInfo kern = {};
+  if (kernstore != nullptr && kernstore->get(left_id, right_id, kern)) {
+    x = kern.x;
+    y = kern.y;
+    return true;
+  }
 
   FT_Vector delta = {};
 
@@ -392,12 +735,22 @@ bool FreetypeCache::get_kerning(uint32_t left, uint32_t right, long &x, long &y)
   x = delta.x;
   y = delta.y;
 
+  if (kernstore != nullptr) {
+    kern.x = x;
+    kern.y = y;
+    size_t bytes = kernstore->bytes();
+    kernstore->add(left_id, right_id, kern);
+    if (kernstore->bytes() != bytes) {
+      update_size_cost();
+    }
+  }
+
   return true;
 }
-bool FreetypeCache::apply_kerning(uint32_t left, uint32_t right, long &x, long &y) {
+bool FreetypeCache::apply_kerning(FT_UInt left_id, FT_UInt right_id, long &x, long &y) {
   long delta_x = 0, delta_y = 0;
 
-  if (!get_kerning(left, right, delta_x, delta_y)) {
+  if (!get_kerning(left_id, right_id, delta_x, delta_y)) {
     return false;
   }
 
@@ -491,6 +844,31 @@ int FreetypeCache::n_axes() {
   return n;
 }
 
+void FreetypeCache::set_glyphstore() {
+  if (size_store == nullptr) {
+    glyphstore = nullptr;
+    kernstore = nullptr;
+    return;
+  }
+  size_t n_stores = size_store->glyphs.size();
+  glyphstore = &(size_store->glyphs[cur_var]);
+  kernstore = &(size_store->kerning[cur_var]);
+  if (size_store->glyphs.size() != n_stores) {
+    update_size_cost();
+  }
+}
+
+// The stores of the current size grow as glyphs are measured so its cost is
+// updated whenever they allocate. The current size is the most recently used
+// so only other sizes are evicted to make room
+void FreetypeCache::update_size_cost() {
+  size_cache.update_cost(SizeID(cur_id, cur_size, cur_res));
+  SizeID removed_size;
+  while (size_cache.trim(removed_size)) {
+    face_cache.remove_size_id(removed_size.face, removed_size);
+  }
+}
+
 bool FreetypeCache::is_variable() {
   bool variable = false;
   FT_MM_Var* variations = nullptr;
@@ -502,13 +880,22 @@ bool FreetypeCache::is_variable() {
   return variable;
 }
 
-inline int var_hash(const int* axes, const int* vals, size_t n) {
-  int hash = 0;
-  for (size_t i = 0; i < n; ++i) {
-    hash ^= std::hash<int>()(axes[i]);
-    hash ^= std::hash<int>()(vals[i]);
+// Variations are identified by the exact axes and values they were set with.
+// The glyph and kerning stores and the shape cache are keyed on this id so it
+// must never be shared by two different variations. 0 is the default
+int FreetypeCache::variation_id(const int* axes, const int* vals, size_t n) {
+  if (n == 0) {
+    return 0;
   }
-  return hash;
+  std::string key((const char*) axes, n * sizeof(int));
+  key.append((const char*) vals, n * sizeof(int));
+  std::unordered_map<std::string, int>::iterator it = var_ids.find(key);
+  if (it != var_ids.end()) {
+    return it->second;
+  }
+  int id = var_ids.size() + 1;
+  var_ids.emplace(key, id);
+  return id;
 }
 
 void FreetypeCache::set_axes(const int* axes, const int* vals, size_t n) {
@@ -517,15 +904,16 @@ void FreetypeCache::set_axes(const int* axes, const int* vals, size_t n) {
     return;
   }
 
-  int this_var = var_hash(axes, vals, n);
+  int this_var = variation_id(axes, vals, n);
   if (this_var == cur_var) return;
 
   std::vector<FT_Fixed> fvals;
 
   if (n == 0) {
     FT_Set_Var_Design_Coordinates(face, 0, fvals.data());
-    glyphstore.clear();
     cur_var = this_var;
+    face_cache.set_var(cur_id, cur_var);
+    set_glyphstore();
     return;
   }
 
@@ -544,8 +932,21 @@ void FreetypeCache::set_axes(const int* axes, const int* vals, size_t n) {
   }
   FT_Done_MM_Var(library, variations);
   FT_Set_Var_Design_Coordinates(face, fvals.size(), fvals.data());
-  glyphstore.clear();
   cur_var = this_var;
+  face_cache.set_var(cur_id, cur_var);
+  set_glyphstore();
+}
+
+int FreetypeCache::get_variation(const char* file, int index) {
+  return get_variation(file_id(file), index);
+}
+
+int FreetypeCache::get_variation(FileID file, int index) {
+  FaceID id(file, index);
+  if (id == cur_id) {
+    return cur_var;
+  }
+  return face_cache.get_var(id);
 }
 
 int FreetypeCache::get_weight() {
@@ -589,16 +990,75 @@ void FreetypeCache::get_family_name(char* family, int max_length) {
   strncpy(family, face->family_name, max_length);
 }
 
+// FreetypeCache keeps track of a current face and FreeType objects must not be
+// used from multiple threads at once. Because of this each thread gets its own
+// cache (with its own FT_Library). The main R thread uses the cache created at
+// load time while other threads get one created on first use which is freed
+// when the thread exits
 static FreetypeCache* font_cache;
+static std::mutex thread_caches_mutex;
+static std::unordered_set<FreetypeCache*> thread_caches;
+static thread_local FreetypeCache* cur_font_cache = nullptr;
+
+struct ThreadCacheOwner {
+  ~ThreadCacheOwner() {
+    if (cur_font_cache == nullptr || cur_font_cache == font_cache) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(thread_caches_mutex);
+    // Might have been freed already if the package was unloaded
+    if (thread_caches.erase(cur_font_cache) != 0) {
+      delete cur_font_cache;
+    }
+    cur_font_cache = nullptr;
+  }
+};
 
 FreetypeCache& get_font_cache() {
-  return *font_cache;
+  if (cur_font_cache == nullptr) {
+    FreetypeCache* cache = new FreetypeCache();
+    {
+      std::lock_guard<std::mutex> lock(thread_caches_mutex);
+      thread_caches.insert(cache);
+    }
+    cur_font_cache = cache;
+    // Makes sure the cache is freed when the thread exits
+    static thread_local ThreadCacheOwner owner;
+  }
+  return *cur_font_cache;
+}
+
+// The budgets are split between the caches of all threads. Only the cache of
+// the calling thread is trimmed right away as the others may be in use. They
+// apply their new share the next time they load a font
+cpp11::doubles font_cache_budget_c(double faces, double sizes) {
+  cpp11::writable::doubles old({
+    double(face_budget.bytes()),
+    double(size_budget.bytes())
+  });
+  if (faces >= 0) {
+    face_budget.set_bytes(size_t(faces));
+  }
+  if (sizes >= 0) {
+    size_budget.set_bytes(size_t(sizes));
+  }
+  get_font_cache().check_budget();
+  return old;
 }
 
 void init_ft_caches(DllInfo* dll) {
   font_cache = new FreetypeCache();
+  cur_font_cache = font_cache;
 }
 
 void unload_ft_caches(DllInfo* dll) {
+  {
+    std::lock_guard<std::mutex> lock(thread_caches_mutex);
+    for (FreetypeCache* cache : thread_caches) {
+      delete cache;
+    }
+    thread_caches.clear();
+  }
   delete font_cache;
+  cur_font_cache = nullptr;
 }
@@ -1,12 +1,14 @@
 #pragma once
 
 #include <cpp11/R.hpp>
+#include <cpp11/doubles.hpp>
 #include <R_ext/Rdynload.h>
 #include <cstdint>
+#include <cstring>
 #include <vector>
 #include <string>
-#include <map>
 #include <unordered_set>
+#include <unordered_map>
 #include <memory>
 #include <functional>
 #include <ft2build.h>
@@ -21,16 +23,45 @@
 #endif
 
 #include "cache_lru.h"
+#include "cache_glyph.h"
+#include "cache_stats.h"
+
+
+// Font files are identified by a small integer id so the caches don't need to
+// hash and compare paths. Ids are shared by all threads and never released
+typedef unsigned int FileID;
+
+FileID intern_font_file(const char* path);
+const char* font_file_path(FileID id);
+
+// Whether the first face in a font file has a weight, width, or italic axis.
+// The file is opened on the first request and the answer is remembered until
+// clear_font_file_axes() is called
+void font_file_axes(FileID id, bool& weight, bool& width, bool& italic);
+void clear_font_file_axes();
+
+// Finalizer from splitmix64. Spreads the bits of the input across the result
+inline uint64_t hash_mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= UINT64_C(0xbf58476d1ce4e5b9);
+  x ^= x >> 27;
+  x *= UINT64_C(0x94d049bb133111eb);
+  x ^= x >> 31;
+  return x;
+}
 
+inline uint64_t hash_double(double x) {
+  uint64_t bits;
+  std::memcpy(&bits, &x, sizeof(double));
+  return bits;
+}
 
 struct FaceID {
-  std::string file;
+  FileID file;
   unsigned int index;
 
-  inline FaceID() : file(""), index(0) {}
-  inline FaceID(std::string f) : file(f), index(0) {}
-  inline FaceID(std::string f, unsigned int i) : file(f), index(i) {}
-  inline FaceID(const FaceID& face) : file(face.file), index(face.index) {}
+  inline FaceID() : file(0), index(0) {}
+  inline FaceID(FileID f, unsigned int i) : file(f), index(i) {}
 
   inline bool operator==(const FaceID &other) const {
     return (index == other.index && file == other.file);
@@ -43,7 +74,6 @@ struct SizeID {
 
   inline SizeID() : face(), size(-1.0), res(-1.0) {}
   inline SizeID(FaceID f, double s, double r) : face(f), size(s), res(r) {}
-  inline SizeID(const SizeID& s) : face(s.face), size(s.size), res(s.res) {}
 
   inline bool operator==(const SizeID &other) const {
     return (size == other.size && res == other.res && face == other.face);
@@ -54,13 +84,15 @@ namespace std {
 template <>
 struct hash<FaceID> {
   size_t operator()(const FaceID & x) const {
-    return std::hash<std::string>()(x.file) ^ std::hash<unsigned int>()(x.index);
+    return (size_t) hash_mix(((uint64_t) x.file << 32) | x.index);
   }
 };
 template<>
 struct hash<SizeID> {
   size_t operator()(const SizeID & x) const {
-    return std::hash<FaceID>()(x.face) ^ std::hash<double>()(x.size) ^ std::hash<double>()(x.res);
+    uint64_t h = hash_mix(((uint64_t) x.face.file << 32) | x.face.index);
+    h = hash_mix(h ^ hash_double(x.size));
+    return (size_t) hash_mix(h ^ hash_double(x.res));
   }
 };
 }
@@ -68,9 +100,11 @@ struct hash<SizeID> {
 struct FaceStore {
   FT_Face face;
   std::unordered_set<SizeID> sizes;
+  int var;
+  size_t cost;
 
-  FaceStore() : sizes() {};
-  FaceStore(FT_Face f) : face(f), sizes() {}
+  FaceStore() : face(nullptr), sizes(), var(0), cost(0) {};
+  FaceStore(FT_Face f, size_t c) : face(f), sizes(), var(0), cost(c) {}
 };
 
 struct FontFaceInfo {
@@ -100,16 +134,30 @@ struct FontFaceInfo {
   long underline_size;
 };
 
-struct GlyphInfo {
-  unsigned index;
-  std::string name;
-  long x_bearing;
-  long y_bearing;
-  long width;
-  long height;
-  long x_advance;
-  long y_advance;
-  std::vector<long> bbox;
+// A sized face along with the glyph metrics and kerning that have been
+// calculated at that size. Both are stored per variation state as these
+// affects the metrics. cost is the fixed cost of the size itself while the
+// stores are charged for the memory they hold as they grow
+struct SizeStore {
+  FT_Size size;
+  std::unordered_map<int, GlyphStore> glyphs;
+  std::unordered_map<int, KerningStore> kerning;
+  size_t cost;
+
+  SizeStore() : size(nullptr), glyphs(), kerning(), cost(0) {}
+  SizeStore(FT_Size s, size_t c) : size(s), glyphs(), kerning(), cost(c) {}
+
+  // Memory held by the glyph metrics and kerning of all variations
+  size_t store_bytes() const {
+    size_t bytes = 0;
+    for (std::unordered_map<int, GlyphStore>::const_iterator it = glyphs.begin(); it != glyphs.end(); ++it) {
+      bytes += it->second.bytes();
+    }
+    for (std::unordered_map<int, KerningStore>::const_iterator it = kerning.begin(); it != kerning.end(); ++it) {
+      bytes += it->second.bytes();
+    }
+    return bytes;
+  }
 };
 
 struct VariationInfo {
@@ -121,12 +169,6 @@ struct VariationInfo {
 };
 
 class FaceCache : public LRU_Cache<FaceID, FaceStore> {
-  using typename LRU_Cache<FaceID, FaceStore>::key_value_t;
-  using typename LRU_Cache<FaceID, FaceStore>::list_t;
-  using typename LRU_Cache<FaceID, FaceStore>::cache_list_it_t;
-  using typename LRU_Cache<FaceID, FaceStore>::map_t;
-  using typename LRU_Cache<FaceID, FaceStore>::cache_map_it_t;
-
 public:
   FaceCache() :
   LRU_Cache<FaceID, FaceStore>() {
@@ -136,33 +178,89 @@ public:
   LRU_Cache<FaceID, FaceStore>(max_size) {
 
   }
+  FaceCache(size_t max_size, size_t max_cost) :
+  LRU_Cache<FaceID, FaceStore>(max_size, max_cost) {
+
+  }
+
+  void add_size_id(const FaceID& fid, const SizeID& sid) {
+    FaceStore* face = steal(fid);
+    if (face == nullptr) {
+      return;
+    }
+    face->sizes.insert(sid);
+  }
+
+  void remove_size_id(const FaceID& fid, const SizeID& sid) {
+    FaceStore* face = steal(fid);
+    if (face == nullptr) {
+      return;
+    }
+    face->sizes.erase(sid);
+  }
 
-  void add_size_id(FaceID fid, SizeID sid) {
-    cache_map_it_t it = _cache_map.find(fid);
-    if (it == _cache_map.end()) {
+  // Record the variation currently set on the face as it is a property of the
+  // face rather than the size
+  void set_var(const FaceID& fid, int var) {
+    FaceStore* face = steal(fid);
+    if (face == nullptr) {
       return;
     }
-    it->second->second.sizes.insert(sid);
+    face->var = var;
+  }
+
+  // The variation set on a cached face. Faces that aren't cached will be
+  // loaded with the default variation
+  int get_var(const FaceID& fid) {
+    FaceStore* face = steal(fid);
+    if (face == nullptr) {
+      return 0;
+    }
+    return face->var;
   }
 private:
   inline virtual void value_dtor(FaceStore& value) {
     FT_Done_Face(value.face);
   }
+  inline virtual size_t value_cost(const FaceStore& value) {
+    return value.cost;
+  }
 };
 
-class SizeCache : public LRU_Cache<SizeID, FT_Size> {
+class SizeCache : public LRU_Cache<SizeID, SizeStore*> {
 public:
   SizeCache() :
-  LRU_Cache<SizeID, FT_Size>() {
+  LRU_Cache<SizeID, SizeStore*>() {
 
   }
   SizeCache(size_t max_size) :
-  LRU_Cache<SizeID, FT_Size>(max_size) {
+  LRU_Cache<SizeID, SizeStore*>(max_size) {
 
   }
+  SizeCache(size_t max_size, size_t max_cost) :
+  LRU_Cache<SizeID, SizeStore*>(max_size, max_cost) {
+
+  }
+
+  // Number of glyph metrics cached across all sizes and the memory used by
+  // them along with the cached kerning
+  void glyph_usage(size_t& entries, size_t& bytes) {
+    entries = 0;
+    bytes = 0;
+    for_each([&](const SizeID& id, SizeStore* store) {
+      for (std::unordered_map<int, GlyphStore>::iterator g = store->glyphs.begin(); g != store->glyphs.end(); ++g) {
+        entries += g->second.size();
+      }
+      bytes += store->store_bytes();
+    });
+  }
 private:
-  inline virtual void value_dtor(FT_Size& value) {
-    FT_Done_Size(value);
+  inline virtual void value_dtor(SizeStore*& value) {
+    FT_Done_Size(value->size);
+    delete value;
+  }
+  inline virtual size_t value_cost(SizeStore* const& value) {
+    return value->cost + value->store_bytes();
   }
 };
 
@@ -173,19 +271,23 @@ public:
 
   bool load_font(const char* file, int index, double size, double res);
   bool load_font(const char* file, int index);
+  bool load_font(FileID file, int index, double size, double res);
+  bool load_font(FileID file, int index);
+  FileID file_id(const char* file);
   FontFaceInfo font_info();
   bool has_glyph(uint32_t index);
   bool load_unicode(uint32_t index);
   bool load_glyph(FT_UInt index, int flags = FT_LOAD_DEFAULT);
   GlyphInfo glyph_info();
   GlyphInfo cached_glyph_info(uint32_t index, int& error);
+  std::string glyph_name(FT_UInt index);
   double string_width(uint32_t* string, int length, bool add_kern);
   long cur_lineheight();
   long cur_ascender();
   long cur_descender();
   bool cur_is_variable();
-  bool get_kerning(uint32_t left, uint32_t right, long &x, long &y);
-  bool apply_kerning(uint32_t left, uint32_t right, long &x, long &y);
+  bool get_kerning(FT_UInt left_id, FT_UInt right_id, long &x, long &y);
+  bool apply_kerning(FT_UInt left_id, FT_UInt right_id, long &x, long &y);
   double tracking_diff(double tracking);
   FT_Face get_face();
   FT_Face get_referenced_face();
@@ -197,15 +299,26 @@ public:
   void has_axes(bool& weight, bool& width, bool& italic);
   int n_axes();
   void set_axes(const int* axes, const int* vals, size_t n);
+  int get_variation(const char* file, int index);
+  int get_variation(FileID file, int index);
+  void set_budget(size_t face_bytes, size_t size_bytes);
+  void check_budget();
+  CacheStats face_stats();
+  CacheStats size_stats();
+  CacheStats glyph_stats();
+  void reset_stats();
   int error_code;
+  TimingStats new_face_time;
+  TimingStats new_size_time;
+  TimingStats load_glyph_time;
 
 private:
   FT_Library library;
-  std::map<uint32_t, GlyphInfo> glyphstore;
   FaceCache face_cache;
   SizeCache size_cache;
 
   FaceID cur_id;
+  const char* cur_path;
   int cur_var;
   double cur_size;
   double cur_res;
@@ -217,20 +330,40 @@ private:
 
   FT_Face face;
   FT_Size size;
+  SizeStore* size_store;
+  GlyphStore* glyphstore;
+  KerningStore* kernstore;
+  size_t glyph_hits;
+  size_t glyph_misses;
+  unsigned face_budget_gen;
+  unsigned size_budget_gen;
 
   bool load_face(FaceID face);
   bool load_size(FaceID face, double size, double res);
+  void set_current(FaceID id);
+  void reset_current();
+  void release_face(FaceStore& face);
 
   inline bool current_face(FaceID id, double size, double res) {
     return size == cur_size && res == cur_res && id == cur_id;
   };
 
+  // Ids handed out to the variations set on this cache, keyed on their axes
+  // and values
+  std::unordered_map<std::string, int> var_ids;
+
   bool is_variable();
+  void set_glyphstore();
+  void update_size_cost();
+  int variation_id(const int* axes, const int* vals, size_t n);
 
 };
 
 FreetypeCache& get_font_cache();
 
+[[cpp11::register]]
+cpp11::doubles font_cache_budget_c(double faces, double sizes);
+
 [[cpp11::init]]
 void init_ft_caches(DllInfo* dll);
 
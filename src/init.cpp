@@ -1,7 +1,11 @@
 #include <cpp11/R.hpp>
 #include "caches.h"
+#include "font_local.h"
+#include "string_metrics.h"
 
 extern "C" void R_unload_systemfonts(DllInfo *dll) {
+  unload_local_fonts();
+  unload_shape_workers();
   unload_caches(dll);
   unload_ft_caches(dll);
 }
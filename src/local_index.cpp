@@ -0,0 +1,285 @@
+#include "local_index.h"
+
+#include <cstdio>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+// Index files start with a magic number and a format version. Files with any
+// other header are ignored and replaced on the next write
+static const char INDEX_MAGIC[4] = {'S', 'F', 'L', 'I'};
+static const uint32_t INDEX_VERSION = 1;
+static const uint32_t NULL_STRING = UINT32_MAX;
+
+enum LocalFaceFlags {
+  FaceItalic    = 1,
+  FaceMonospace = 2,
+  FaceVariable  = 4
+};
+
+bool local_file_stamp(const std::string& path, int64_t& size, int64_t& mtime) {
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0) {
+    return false;
+  }
+  size = (int64_t) info.st_size;
+  mtime = (int64_t) info.st_mtime;
+  return true;
+}
+
+// Sequential reader over the raw content of an index file. Every read checks
+// the remaining length so a truncated or corrupt file is rejected rather than
+// read past its end
+class IndexReader {
+public:
+  IndexReader(const std::string& data) : _data(data), _pos(0) {}
+
+  template<typename T>
+  inline bool read(T& value) {
+    if (_data.size() - _pos < sizeof(T)) {
+      return false;
+    }
+    std::memcpy(&value, _data.data() + _pos, sizeof(T));
+    _pos += sizeof(T);
+    return true;
+  }
+
+  // Strings are returned as NULL if they were NULL when written
+  inline bool read(std::string& value, bool& is_null) {
+    uint32_t length;
+    if (!read(length)) {
+      return false;
+    }
+    is_null = length == NULL_STRING;
+    if (is_null) {
+      value.clear();
+      return true;
+    }
+    if (_data.size() - _pos < length) {
+      return false;
+    }
+    value.assign(_data, _pos, length);
+    _pos += length;
+    return true;
+  }
+
+  inline size_t remaining() const {
+    return _data.size() - _pos;
+  }
+
+private:
+  const std::string& _data;
+  size_t _pos;
+};
+
+class IndexWriter {
+public:
+  IndexWriter() : _data() {}
+
+  template<typename T>
+  inline void write(T value) {
+    _data.append((const char*) &value, sizeof(T));
+  }
+
+  inline void write(const char* value) {
+    if (value == NULL) {
+      write(NULL_STRING);
+      return;
+    }
+    uint32_t length = std::strlen(value);
+    write(length);
+    _data.append(value, length);
+  }
+
+  inline const std::string& str() const {
+    return _data;
+  }
+
+private:
+  std::string _data;
+};
+
+LocalIndex::~LocalIndex() {
+  clear();
+}
+
+void LocalIndex::clear() {
+  for (file_map_t::iterator it = _files.begin(); it != _files.end(); ++it) {
+    for (size_t i = 0; i < it->second.faces.size(); ++i) {
+      delete it->second.faces[i];
+    }
+  }
+  _files.clear();
+  _dirty = false;
+}
+
+bool LocalIndex::read(const std::string& file) {
+  clear();
+
+  FILE* f = fopen(file.c_str(), "rb");
+  if (f == NULL) {
+    return false;
+  }
+  std::string data;
+  char buffer[8192];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    data.append(buffer, n);
+  }
+  fclose(f);
+
+  IndexReader reader(data);
+  char magic[4];
+  uint32_t version, n_files;
+  if (!reader.read(magic) || std::memcmp(magic, INDEX_MAGIC, 4) != 0 ||
+      !reader.read(version) || version != INDEX_VERSION ||
+      !reader.read(n_files)) {
+    return false;
+  }
+
+  std::string path, psname, family, style;
+  bool path_null, psname_null, family_null, style_null;
+  for (uint32_t i = 0; i < n_files; ++i) {
+    LocalFile entry;
+    uint32_t n_faces;
+    if (!reader.read(path, path_null) || path_null ||
+        !reader.read(entry.size) || !reader.read(entry.mtime) ||
+        !reader.read(n_faces) || n_faces > reader.remaining()) {
+      clear();
+      return false;
+    }
+    // A path should only appear once but if it doesn't the last entry wins
+    LocalFile& stored = _files[path];
+    for (size_t j = 0; j < stored.faces.size(); ++j) {
+      delete stored.faces[j];
+    }
+    stored.faces.clear();
+    stored.size = entry.size;
+    stored.mtime = entry.mtime;
+    for (uint32_t j = 0; j < n_faces; ++j) {
+      int32_t index, weight, width;
+      uint8_t flags;
+      if (!reader.read(index) ||
+          !reader.read(psname, psname_null) ||
+          !reader.read(family, family_null) ||
+          !reader.read(style, style_null) ||
+          !reader.read(weight) || !reader.read(width) || !reader.read(flags)) {
+        clear();
+        return false;
+      }
+      stored.faces.push_back(new FontDescriptor(
+        path.c_str(), index,
+        psname_null ? NULL : psname.c_str(),
+        family_null ? NULL : family.c_str(),
+        style_null ? NULL : style.c_str(),
+        (FontWeight) weight,
+        (FontWidth) width,
+        flags & FaceItalic,
+        flags & FaceMonospace,
+        flags & FaceVariable
+      ));
+    }
+  }
+  return true;
+}
+
+bool LocalIndex::write(const std::string& file) {
+  if (!_dirty) {
+    return true;
+  }
+
+  int64_t size, mtime;
+  for (file_map_t::iterator it = _files.begin(); it != _files.end();) {
+    if (local_file_stamp(it->first, size, mtime)) {
+      ++it;
+      continue;
+    }
+    for (size_t i = 0; i < it->second.faces.size(); ++i) {
+      delete it->second.faces[i];
+    }
+    it = _files.erase(it);
+  }
+
+  IndexWriter writer;
+  writer.write(INDEX_MAGIC[0]);
+  writer.write(INDEX_MAGIC[1]);
+  writer.write(INDEX_MAGIC[2]);
+  writer.write(INDEX_MAGIC[3]);
+  writer.write(INDEX_VERSION);
+  writer.write((uint32_t) _files.size());
+  for (file_map_t::iterator it = _files.begin(); it != _files.end(); ++it) {
+    writer.write(it->first.c_str());
+    writer.write(it->second.size);
+    writer.write(it->second.mtime);
+    writer.write((uint32_t) it->second.faces.size());
+    for (size_t i = 0; i < it->second.faces.size(); ++i) {
+      FontDescriptor* face = it->second.faces[i];
+      writer.write((int32_t) face->index);
+      writer.write(face->postscriptName);
+      writer.write(face->family);
+      writer.write(face->style);
+      writer.write((int32_t) face->weight);
+      writer.write((int32_t) face->width);
+      writer.write((uint8_t) (
+        (face->italic ? FaceItalic : 0) |
+        (face->monospace ? FaceMonospace : 0) |
+        (face->variable ? FaceVariable : 0)
+      ));
+    }
+  }
+
+  // Another R session may write the same index so each uses its own
+  // temporary file
+  std::string tmp = file + "." + std::to_string((long) getpid()) + ".tmp";
+  FILE* f = fopen(tmp.c_str(), "wb");
+  if (f == NULL) {
+    return false;
+  }
+  const std::string& data = writer.str();
+  bool success = fwrite(data.data(), 1, data.size(), f) == data.size();
+  success = fclose(f) == 0 && success;
+#ifdef _WIN32
+  // rename() doesn't replace existing files on Windows
+  if (success) {
+    std::remove(file.c_str());
+  }
+#endif
+  if (!success || std::rename(tmp.c_str(), file.c_str()) != 0) {
+    std::remove(tmp.c_str());
+    return false;
+  }
+  _dirty = false;
+  return true;
+}
+
+bool LocalIndex::lookup(const std::string& path, int64_t size, int64_t mtime, std::vector<FontDescriptor*>& faces) {
+  file_map_t::iterator it = _files.find(path);
+  if (it == _files.end() || it->second.size != size || it->second.mtime != mtime) {
+    return false;
+  }
+  for (size_t i = 0; i < it->second.faces.size(); ++i) {
+    faces.push_back(new FontDescriptor(it->second.faces[i]));
+  }
+  return true;
+}
+
+void LocalIndex::update(const std::string& path, int64_t size, int64_t mtime, const std::vector<FontDescriptor*>& faces) {
+  LocalFile& entry = _files[path];
+  for (size_t i = 0; i < entry.faces.size(); ++i) {
+    delete entry.faces[i];
+  }
+  entry.faces.clear();
+  entry.size = size;
+  entry.mtime = mtime;
+  for (size_t i = 0; i < faces.size(); ++i) {
+    entry.faces.push_back(new FontDescriptor(faces[i]));
+  }
+  _dirty = true;
+}
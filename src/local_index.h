@@ -0,0 +1,52 @@
+#pragma once
+
+#include "FontDescriptor.h"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+// An on-disk record of the faces found in local font files, so that files that
+// haven't changed since they were last scanned don't have to be opened again.
+// Files are identified by their path, size, and modification time
+struct LocalFile {
+  int64_t size;
+  int64_t mtime;
+  std::vector<FontDescriptor*> faces;
+
+  LocalFile() : size(-1), mtime(-1), faces() {}
+};
+
+class LocalIndex {
+public:
+  LocalIndex() : _files(), _dirty(false) {}
+  ~LocalIndex();
+
+  // Read an index file, replacing the current content. Returns false if the
+  // file doesn't exist or isn't a valid index, in which case the index is empty
+  bool read(const std::string& file);
+  // Write the index if it has changed since it was read. Entries for files that
+  // no longer exist are dropped. The index is written to a temporary file that
+  // then replaces the old one so a failed write won't leave a broken index
+  bool write(const std::string& file);
+
+  // Copy the faces stored for a file into faces if the file hasn't changed.
+  // Returns false if the file must be scanned
+  bool lookup(const std::string& path, int64_t size, int64_t mtime, std::vector<FontDescriptor*>& faces);
+  // Record the faces found in a file. A file without faces is stored as well
+  // so that it isn't scanned again
+  void update(const std::string& path, int64_t size, int64_t mtime, const std::vector<FontDescriptor*>& faces);
+
+private:
+  typedef std::unordered_map<std::string, LocalFile> file_map_t;
+
+  file_map_t _files;
+  bool _dirty;
+
+  void clear();
+};
+
+// Size and modification time of a file. Returns false if the file can't be
+// accessed
+bool local_file_stamp(const std::string& path, int64_t& size, int64_t& mtime);
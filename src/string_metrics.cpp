@@ -1,6 +1,17 @@
 #include "string_metrics.h"
 #include "string_shape.h"
 #include "utils.h"
+#include "types.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <system_error>
 
 #include <cpp11/data_frame.hpp>
 #include <cpp11/named_arg.hpp>
@@ -19,128 +30,464 @@ using doubles_w = cpp11::writable::doubles;
 
 using namespace cpp11::literals;
 
+// The smallest number of strings worth handing to a shaping thread
+static const int SHAPE_CHUNK_MIN = 256;
+static const int SHAPE_THREADS_MAX = 64;
+
+// Shapers are reused per thread so their buffers stay allocated between calls
+static FreetypeShaper& get_thread_shaper() {
+  static thread_local FreetypeShaper shaper;
+  return shaper;
+}
+
+// Threads for parallel shaping are started on first use and kept until the
+// package is unloaded, so the font, shape, and width caches they hold through
+// thread_local storage stay warm between calls. Jobs must not touch the R API
+class ShapeWorkers {
+public:
+  ShapeWorkers() : threads(), job(), round(0), n_wanted(0), n_busy(0), stopping(false) {}
+
+  // Runs job on the calling thread and on up to n_threads - 1 workers, and
+  // returns once all of them are done
+  void run(int n_threads, const std::function<void()>& fun) {
+    int n_workers = start_workers(n_threads - 1);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job = fun;
+      n_wanted = n_workers;
+      n_busy = n_workers;
+      round++;
+    }
+    wake.notify_all();
+    fun();
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return n_busy == 0; });
+    job = nullptr;
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < threads.size(); ++i) {
+      threads[i].join();
+    }
+    threads.clear();
+  }
+
+private:
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  std::function<void()> job;
+  size_t round;
+  int n_wanted;
+  int n_busy;
+  bool stopping;
+
+  // Returns the number of workers available, which may be fewer than
+  // requested if the system refuses to start more threads
+  int start_workers(int n) {
+    while ((int) threads.size() < n) {
+      try {
+        // New workers wait for the next round rather than joining the last
+        threads.emplace_back(&ShapeWorkers::work, this, (int) threads.size(), round);
+      } catch (const std::system_error&) {
+        break;
+      }
+    }
+    return std::min(n, (int) threads.size());
+  }
+
+  void work(int worker, size_t seen) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wake.wait(lock, [&]() { return stopping || round != seen; });
+      if (stopping) {
+        return;
+      }
+      seen = round;
+      if (worker >= n_wanted) {
+        continue;
+      }
+      std::function<void()> fun = job;
+      lock.unlock();
+      fun();
+      lock.lock();
+      if (--n_busy == 0) {
+        done.notify_one();
+      }
+    }
+  }
+};
+
+// Never destroyed at exit as the workers may be blocked in a wait. They are
+// stopped when the package is unloaded instead
+static ShapeWorkers* shape_workers = nullptr;
+
+void unload_shape_workers() {
+  if (shape_workers != nullptr) {
+    shape_workers->stop();
+    delete shape_workers;
+    shape_workers = nullptr;
+  }
+}
+
+// The glyphs and metrics of a consecutive run of shaped strings. metric_id is
+// local to the chunk and gets offset when the chunks are combined
+struct ShapeChunk {
+  int start;
+  int end;
+  std::vector<int> glyph;
+  std::vector<int> glyph_id;
+  std::vector<int> metric_id;
+  std::vector<int> string_id;
+  std::vector<double> x_offset;
+  std::vector<double> y_offset;
+  std::vector<double> x_midpoint;
+  std::vector<double> metrics[10];
+  int error_code;
+  int error_at;
+};
+
+// The shaping input with all R data already resolved so it can be read from
+// other threads
+struct ShapeInput {
+  const int* id;
+  std::vector<const char*> string;
+  std::vector<const char*> path;
+  std::vector<FileID> file;
+  const int* index;
+  const double* size;
+  const double* res;
+  const double* lineheight;
+  const int* align;
+  const double* hjust;
+  const double* vjust;
+  const double* width;
+  const double* tracking;
+  const double* indent;
+  const double* hanging;
+  const double* space_before;
+  const double* space_after;
+  bool one_path;
+  bool one_size;
+  bool one_res;
+  bool one_lht;
+  bool one_align;
+  bool one_hjust;
+  bool one_vjust;
+  bool one_width;
+  bool one_tracking;
+  bool one_indent;
+  bool one_hanging;
+  bool one_before;
+  bool one_after;
+};
+
+// Shaping results are cached on all the input that affects them. The key
+// starts with the paragraph settings, followed by each string and its font
+static inline void add_paragraph_key(ResultKey& key, double res, double lineheight,
+                                     int align, double hjust, double vjust,
+                                     double width, double indent, double hanging,
+                                     double before, double after) {
+  key.add(res);
+  key.add(lineheight);
+  key.add(align);
+  key.add(hjust);
+  key.add(vjust);
+  key.add(width);
+  key.add(indent);
+  key.add(hanging);
+  key.add(before);
+  key.add(after);
+}
+
+static inline void add_string_key(ResultKey& key, const char* string,
+                                  FileID file, int index, double size,
+                                  double tracking, int variation) {
+  key.add(string);
+  key.add((int) file);
+  key.add(index);
+  key.add(size);
+  key.add(tracking);
+  key.add(variation);
+}
+
+static void shape_chunk(const ShapeInput& in, FreetypeShaper& shaper, ShapeChunk& chunk) {
+  FreetypeCache& cache = get_font_cache();
+  ResultKey key;
+  bool success = false;
+  int group_end = chunk.start;
+  for (int group_start = chunk.start; group_start < chunk.end; group_start = group_end) {
+    // Find the strings that are shaped together
+    group_end = group_start + 1;
+    while (group_end < chunk.end && in.id[group_end] == in.id[group_start]) {
+      group_end++;
+    }
+    
+    // The paragraph settings are taken from the first string while the font
+    // and size may vary between strings
+    int i = group_start;
+    key.clear();
+    add_paragraph_key(
+      key,
+      in.res[in.one_res ? 0 : i],
+      in.lineheight[in.one_lht ? 0 : i],
+      in.align[in.one_align ? 0 : i],
+      in.hjust[in.one_hjust ? 0 : i],
+      in.vjust[in.one_vjust ? 0 : i],
+      in.width[in.one_width ? 0 : i] * 64,
+      in.indent[in.one_indent ? 0 : i] * 64,
+      in.hanging[in.one_hanging ? 0 : i] * 64,
+      in.space_before[in.one_before ? 0 : i] * 64,
+      in.space_after[in.one_after ? 0 : i] * 64
+    );
+    for (; i < group_end; ++i) {
+      FileID this_file = in.file[in.one_path ? 0 : i];
+      int this_index = in.index[in.one_path ? 0 : i];
+      add_string_key(
+        key,
+        in.string[i],
+        this_file,
+        this_index,
+        in.size[in.one_size ? 0 : i],
+        in.tracking[in.one_tracking ? 0 : i],
+        cache.get_variation(this_file, this_index)
+      );
+    }
+    
+    if (!shaper.get_cached_shape(key.str())) {
+      for (i = group_start; i < group_end; ++i) {
+        FileID this_file = in.file[in.one_path ? 0 : i];
+        int this_index = in.index[in.one_path ? 0 : i];
+        if (i != group_start) {
+          success = shaper.add_string(
+            in.string[i],
+            this_file,
+            this_index,
+            in.size[in.one_size ? 0 : i],
+            in.tracking[in.one_tracking ? 0 : i]
+          );
+        } else {
+          success = shaper.shape_string(
+            in.string[i],
+            this_file,
+            this_index,
+            in.size[in.one_size ? 0 : i],
+            in.res[in.one_res ? 0 : i],
+            in.lineheight[in.one_lht ? 0 : i],
+            in.align[in.one_align ? 0 : i],
+            in.hjust[in.one_hjust ? 0 : i],
+            in.vjust[in.one_vjust ? 0 : i],
+            in.width[in.one_width ? 0 : i] * 64,
+            in.tracking[in.one_tracking ? 0 : i],
+            in.indent[in.one_indent ? 0 : i] * 64,
+            in.hanging[in.one_hanging ? 0 : i] * 64,
+            in.space_before[in.one_before ? 0 : i] * 64,
+            in.space_after[in.one_after ? 0 : i] * 64
+          );
+        }
+        if (!success) {
+          chunk.error_code = shaper.error_code;
+          chunk.error_at = i;
+          return;
+        }
+      }
+      success = shaper.finish_string();
+      if (!success) {
+        chunk.error_code = -1;
+        chunk.error_at = group_end - 1;
+        return;
+      }
+      shaper.cache_shape(key.str());
+    }
+    
+    int n_glyphs = shaper.glyph_id.size();
+    int cur_metric = chunk.metrics[0].size();
+    for (int j = 0; j < n_glyphs; j++) {
+      chunk.glyph.push_back((int) shaper.glyph_uc[j]);
+      chunk.glyph_id.push_back((int) shaper.glyph_id[j]);
+      chunk.metric_id.push_back(cur_metric);
+      chunk.string_id.push_back(shaper.string_id[j] + 1);
+      chunk.x_offset.push_back(double(shaper.x_pos[j]) / 64.0);
+      chunk.y_offset.push_back(double(shaper.y_pos[j]) / 64.0);
+      chunk.x_midpoint.push_back(double(shaper.x_mid[j]) / 64.0);
+    }
+    chunk.metrics[0].push_back(double(shaper.width) / 64.0);
+    chunk.metrics[1].push_back(double(shaper.height) / 64.0);
+    chunk.metrics[2].push_back(double(shaper.left_bearing) / 64.0);
+    chunk.metrics[3].push_back(double(shaper.right_bearing) / 64.0);
+    chunk.metrics[4].push_back(double(shaper.top_bearing) / 64.0);
+    chunk.metrics[5].push_back(double(shaper.bottom_bearing) / 64.0);
+    chunk.metrics[6].push_back(double(shaper.left_border) / 64.0);
+    chunk.metrics[7].push_back(double(shaper.top_border) / 64.0);
+    chunk.metrics[8].push_back(double(shaper.pen_x) / 64.0);
+    chunk.metrics[9].push_back(double(shaper.pen_y) / 64.0);
+  }
+}
+
 list_t get_string_shape_c(strings_t string, integers_t id, strings_t path, integers_t index, 
                         doubles_t size, doubles_t res, doubles_t lineheight, integers_t align, 
                         doubles_t hjust, doubles_t vjust, doubles_t width, doubles_t tracking, 
                         doubles_t indent, doubles_t hanging, doubles_t space_before, 
-                        doubles_t space_after) {
+                        doubles_t space_after, int threads) {
   int n_strings = string.size();
-  bool one_path = path.size() == 1;
-  const char* first_path = Rf_translateCharUTF8(path[0]);
-  int first_index = index[0];
-  bool one_size = size.size() == 1;
-  double first_size = size[0];
-  bool one_res = res.size() == 1;
-  double first_res = res[0];
-  bool one_lht = lineheight.size() == 1;
-  double first_lht = lineheight[0];
-  bool one_align = align.size() == 1;
-  int first_align = align[0];
-  bool one_hjust = hjust.size() == 1;
-  double first_hjust = hjust[0];
-  bool one_vjust = vjust.size() == 1;
-  double first_vjust = vjust[0];
-  bool one_width = width.size() == 1;
-  double first_width = width[0] * 64;
-  bool one_tracking = tracking.size() == 1;
-  double first_tracking = tracking[0];
-  bool one_indent = indent.size() == 1;
-  double first_indent = indent[0] * 64;
-  bool one_hanging = hanging.size() == 1;
-  double first_hanging = hanging[0] * 64;
-  bool one_before = space_before.size() == 1;
-  double first_before = space_before[0] * 64;
-  bool one_after = space_after.size() == 1;
-  double first_after = space_after[0] * 64;
   
-  integers_w glyph;
-  integers_w glyph_id;
-  integers_w metric_id;
-  integers_w string_id;
-  doubles_w x_offset;
-  doubles_w y_offset;
-  doubles_w x_midpoint;
+  // Resolve everything that touches the R API up front
+  ShapeInput in;
+  in.id = INTEGER(id);
+  in.string.resize(n_strings);
+  for (int i = 0; i < n_strings; ++i) {
+    in.string[i] = Rf_translateCharUTF8(string[i]);
+  }
+  in.one_path = path.size() == 1;
+  in.path.resize(path.size());
+  in.file.resize(path.size());
+  for (R_xlen_t i = 0; i < path.size(); ++i) {
+    // Equal paths share their CHARSXP so runs of the same font are only
+    // translated and interned once
+    if (i > 0 && STRING_ELT(path, i) == STRING_ELT(path, i - 1)) {
+      in.path[i] = in.path[i - 1];
+      in.file[i] = in.file[i - 1];
+      continue;
+    }
+    in.path[i] = Rf_translateCharUTF8(path[i]);
+    in.file[i] = intern_font_file(in.path[i]);
+  }
+  in.index = INTEGER(index);
+  in.size = REAL(size);
+  in.res = REAL(res);
+  in.lineheight = REAL(lineheight);
+  in.align = INTEGER(align);
+  in.hjust = REAL(hjust);
+  in.vjust = REAL(vjust);
+  in.width = REAL(width);
+  in.tracking = REAL(tracking);
+  in.indent = REAL(indent);
+  in.hanging = REAL(hanging);
+  in.space_before = REAL(space_before);
+  in.space_after = REAL(space_after);
+  in.one_size = size.size() == 1;
+  in.one_res = res.size() == 1;
+  in.one_lht = lineheight.size() == 1;
+  in.one_align = align.size() == 1;
+  in.one_hjust = hjust.size() == 1;
+  in.one_vjust = vjust.size() == 1;
+  in.one_width = width.size() == 1;
+  in.one_tracking = tracking.size() == 1;
+  in.one_indent = indent.size() == 1;
+  in.one_hanging = hanging.size() == 1;
+  in.one_before = space_before.size() == 1;
+  in.one_after = space_after.size() == 1;
   
-  doubles_w widths;
-  doubles_w heights;
-  doubles_w left_bearings;
-  doubles_w right_bearings;
-  doubles_w top_bearings;
-  doubles_w bottom_bearings;
-  doubles_w left_border;
-  doubles_w top_border;
-  doubles_w pen_x;
-  doubles_w pen_y;
+  // Split the strings into chunks, never breaking up strings sharing an id.
+  // Using a few chunks per thread evens out the load when string lengths vary
+  if (threads < 1 || n_strings < 2 * SHAPE_CHUNK_MIN) {
+    threads = 1;
+  }
+  threads = std::min(threads, SHAPE_THREADS_MAX);
+  int n_chunks = threads == 1 ? 1 : threads * 4;
+  int chunk_size = std::max(SHAPE_CHUNK_MIN, (n_strings + n_chunks - 1) / n_chunks);
+  std::vector<ShapeChunk> chunks;
+  for (int start = 0; start < n_strings; ) {
+    int end = std::min(start + chunk_size, n_strings);
+    while (end < n_strings && in.id[end] == in.id[end - 1]) {
+      end++;
+    }
+    chunks.emplace_back();
+    chunks.back().start = start;
+    chunks.back().end = end;
+    chunks.back().error_code = 0;
+    chunks.back().error_at = -1;
+    start = end;
+  }
+  threads = std::min(threads, (int) chunks.size());
   
   // Shape the text
-  int cur_id = id[0] - 1; // make sure it differs from first
-  bool success = false;
-  
-  FreetypeShaper shaper;
-  for (int i = 0; i < n_strings; ++i) {
-    const char* this_string = Rf_translateCharUTF8(string[i]);
-    int this_id = id[i];
-    if (cur_id == this_id) {
-      success = shaper.add_string(
-        this_string,
-        one_path ? first_path : Rf_translateCharUTF8(path[i]),
-        one_path ? first_index : index[i], 
-        one_size ? first_size : size[i],
-        one_tracking ? first_tracking : tracking[i]
-      );
-      if (!success) {
-        cpp11::stop("Failed to shape string (%s) with font file (%s) with freetype error %i", this_string, Rf_translateCharUTF8(path[i]), shaper.error_code);
-      }
-    } else {
-      cur_id = this_id;
-      success = shaper.shape_string(
-        this_string, 
-        one_path ? first_path : Rf_translateCharUTF8(path[i]), 
-        one_path ? first_index : index[i], 
-        one_size ? first_size : size[i], 
-        one_res ? first_res : res[i],
-        one_lht ? first_lht : lineheight[i],
-        one_align ? first_align : align[i],
-        one_hjust ? first_hjust : hjust[i],
-        one_vjust ? first_vjust : vjust[i],
-        one_width ? first_width : width[i] * 64,
-        one_tracking ? first_tracking : tracking[i],
-        one_indent ? first_indent : indent[i] * 64,
-        one_hanging ? first_hanging : hanging[i] * 64,
-        one_before ? first_before : space_before[i] * 64,
-        one_after ? first_after : space_after[i] * 64
-      );
-      if (!success) {
-        cpp11::stop("Failed to shape string (%s) with font file (%s) with freetype error %i", this_string, Rf_translateCharUTF8(path[i]), shaper.error_code);
-      }
+  if (threads <= 1) {
+    FreetypeShaper shaper;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+      shape_chunk(in, shaper, chunks[i]);
     }
-    bool store_string = i == n_strings - 1 || cur_id != id[i + 1];
-    if (store_string) {
-      success = shaper.finish_string();
-      if (!success) {
-        cpp11::stop("Failed to finalise string shaping");
+  } else {
+    // Each thread has its own shaper and, through get_font_cache(), its own 
+    // FreeType cache
+    if (shape_workers == nullptr) {
+      shape_workers = new ShapeWorkers();
+    }
+    std::atomic<size_t> next_chunk(0);
+    shape_workers->run(threads, [&]() {
+      FreetypeShaper& shaper = get_thread_shaper();
+      for (size_t i = next_chunk++; i < chunks.size(); i = next_chunk++) {
+        shape_chunk(in, shaper, chunks[i]);
       }
-      int n_glyphs = shaper.glyph_id.size();
-      for (int j = 0; j < n_glyphs; j++) {
-        glyph.push_back((int) shaper.glyph_uc[j]);
-        glyph_id.push_back((int) shaper.glyph_id[j]);
-        metric_id.push_back(widths.size());
-        string_id.push_back(shaper.string_id[j] + 1);
-        x_offset.push_back(double(shaper.x_pos[j]) / 64.0);
-        y_offset.push_back(double(shaper.y_pos[j]) / 64.0);
-        x_midpoint.push_back(double(shaper.x_mid[j]) / 64.0);
+    });
+  }
+  
+  size_t n_glyphs = 0;
+  size_t n_metrics = 0;
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    const ShapeChunk& chunk = chunks[i];
+    if (chunk.error_code == -1) {
+      cpp11::stop("Failed to finalise string shaping");
+    }
+    if (chunk.error_code != 0) {
+      int at = chunk.error_at;
+      cpp11::stop("Failed to shape string (%s) with font file (%s) with freetype error %i", in.string[at], in.path[in.one_path ? 0 : at], chunk.error_code);
+    }
+    n_glyphs += chunk.glyph.size();
+    n_metrics += chunk.metrics[0].size();
+  }
+  
+  integers_w glyph(n_glyphs);
+  integers_w glyph_id(n_glyphs);
+  integers_w metric_id(n_glyphs);
+  integers_w string_id(n_glyphs);
+  doubles_w x_offset(n_glyphs);
+  doubles_w y_offset(n_glyphs);
+  doubles_w x_midpoint(n_glyphs);
+  
+  doubles_w widths(n_metrics);
+  doubles_w heights(n_metrics);
+  doubles_w left_bearings(n_metrics);
+  doubles_w right_bearings(n_metrics);
+  doubles_w top_bearings(n_metrics);
+  doubles_w bottom_bearings(n_metrics);
+  doubles_w left_border(n_metrics);
+  doubles_w top_border(n_metrics);
+  doubles_w pen_x(n_metrics);
+  doubles_w pen_y(n_metrics);
+  doubles_w* metrics[10] = {
+    &widths, &heights, &left_bearings, &right_bearings, &top_bearings, 
+    &bottom_bearings, &left_border, &top_border, &pen_x, &pen_y
+  };
+  
+  // Combine the chunks in order
+  R_xlen_t glyph_offset = 0;
+  R_xlen_t metric_offset = 0;
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    const ShapeChunk& chunk = chunks[i];
+    for (size_t j = 0; j < chunk.glyph.size(); ++j) {
+      R_xlen_t k = glyph_offset + j;
+      glyph[k] = chunk.glyph[j];
+      glyph_id[k] = chunk.glyph_id[j];
+      metric_id[k] = chunk.metric_id[j] + metric_offset;
+      string_id[k] = chunk.string_id[j];
+      x_offset[k] = chunk.x_offset[j];
+      y_offset[k] = chunk.y_offset[j];
+      x_midpoint[k] = chunk.x_midpoint[j];
+    }
+    for (size_t j = 0; j < chunk.metrics[0].size(); ++j) {
+      for (int m = 0; m < 10; ++m) {
+        (*metrics[m])[metric_offset + j] = chunk.metrics[m][j];
       }
-      widths.push_back(double(shaper.width) / 64.0);
-      heights.push_back(double(shaper.height) / 64.0);
-      left_bearings.push_back(double(shaper.left_bearing) / 64.0);
-      right_bearings.push_back(double(shaper.right_bearing) / 64.0);
-      top_bearings.push_back(double(shaper.top_bearing) / 64.0);
-      bottom_bearings.push_back(double(shaper.bottom_bearing) / 64.0);
-      left_border.push_back(double(shaper.left_border) / 64.0);
-      top_border.push_back(double(shaper.top_border) / 64.0);
-      pen_x.push_back(double(shaper.pen_x) / 64.0);
-      pen_y.push_back(double(shaper.pen_y) / 64.0);
     }
+    glyph_offset += chunk.glyph.size();
+    metric_offset += chunk.metrics[0].size();
   }
   
   data_frame_w shape_df({
@@ -179,7 +526,7 @@ doubles_t get_line_width_c(strings_t string, strings_t path, integers_t index, d
                          doubles_t res, logicals_t include_bearing) {
   int n_strings = string.size();
   bool one_path = path.size() == 1;
-  const char* first_path = Rf_translateCharUTF8(path[0]);
+  FileID file = intern_font_file(Rf_translateCharUTF8(path[0]));
   int first_index = index[0];
   bool one_size = size.size() == 1;
   double first_size = size[0];
@@ -195,9 +542,12 @@ doubles_t get_line_width_c(strings_t string, strings_t path, integers_t index, d
   FreetypeShaper shaper;
   
   for (int i = 0; i < n_strings; ++i) {
+    if (!one_path && i > 0 && STRING_ELT(path, i) != STRING_ELT(path, i - 1)) {
+      file = intern_font_file(Rf_translateCharUTF8(path[i]));
+    }
     success = shaper.single_line_width(
       Rf_translateCharUTF8(string[i]),
-      one_path ? first_path : Rf_translateCharUTF8(path[i]),
+      file,
       one_path ? first_index : index[i], 
       one_size ? first_size : size[i],
       one_res ? first_res : res[i],
@@ -217,7 +567,7 @@ int string_width(const char* string, const char* fontfile, int index,
                  double size, double res, int include_bearing, double* width) {
   BEGIN_CPP
   
-  FreetypeShaper shaper;
+  FreetypeShaper& shaper = get_thread_shaper();
   long width_tmp = 0;
   bool success = shaper.single_line_width(
     string, fontfile, index, size, res, (bool) include_bearing, width_tmp
@@ -232,19 +582,87 @@ int string_width(const char* string, const char* fontfile, int index,
   return 0;
 }
 
+// Orders string indices so that strings using the same font setting and size
+// are measured consecutively
+struct FontOrder {
+  const FontSettings2* fonts;
+  const double* size;
+
+  bool operator()(int a, int b) const {
+    const FontSettings2& fa = fonts[a];
+    const FontSettings2& fb = fonts[b];
+    int file_cmp = strcmp(fa.file, fb.file);
+    if (file_cmp != 0) return file_cmp < 0;
+    if (fa.index != fb.index) return fa.index < fb.index;
+    if (size[a] != size[b]) return size[a] < size[b];
+    if (fa.n_axes != fb.n_axes) return fa.n_axes < fb.n_axes;
+    for (int i = 0; i < fa.n_axes; ++i) {
+      if (fa.axes[i] != fb.axes[i]) return fa.axes[i] < fb.axes[i];
+      if (fa.coords[i] != fb.coords[i]) return fa.coords[i] < fb.coords[i];
+    }
+    return false;
+  }
+};
+
+int string_widths(const char** strings, int n_strings, const FontSettings2* fonts,
+                  const double* size, double res, int include_bearing, double* widths) {
+  BEGIN_CPP
+
+  std::vector<int> order(n_strings);
+  for (int i = 0; i < n_strings; ++i) {
+    order[i] = i;
+  }
+  FontOrder font_order = {fonts, size};
+  std::stable_sort(order.begin(), order.end(), font_order);
+
+  FreetypeCache& cache = get_font_cache();
+  FreetypeShaper& shaper = get_thread_shaper();
+  long width_tmp = 0;
+
+  for (int i = 0; i < n_strings; ++i) {
+    int j = order[i];
+    if (i == 0 || font_order(order[i - 1], j)) {
+      if (!cache.load_font(fonts[j].file, fonts[j].index, size[j], res)) {
+        return cache.error_code;
+      }
+      cache.set_axes(fonts[j].axes, fonts[j].coords, fonts[j].n_axes);
+    }
+    bool success = shaper.single_line_width(
+      strings[j], cache, (bool) include_bearing, width_tmp
+    );
+    if (!success) {
+      return shaper.error_code;
+    }
+    widths[j] = (double) width_tmp / 64.0;
+  }
+
+  END_CPP
+
+  return 0;
+}
+
 int string_shape(const char* string, const char* fontfile, int index, 
                  double size, double res, double* x, double* y, unsigned int max_length) {
   BEGIN_CPP
   
-  FreetypeShaper shaper;
-  bool success = shaper.shape_string(string, fontfile, index, size, res, 0.0, 0, 
-                                     0.0, 0.0, -1.0, 0.0, 0.0, 0.0, 0.0, 0.0);
-  if (!success) {
-    return shaper.error_code;
-  }
-  success = shaper.finish_string();
-  if (!success) {
-    return shaper.error_code;
+  FreetypeShaper& shaper = get_thread_shaper();
+  FreetypeCache& cache = get_font_cache();
+  FileID file = cache.file_id(fontfile);
+  ResultKey key;
+  add_paragraph_key(key, res, 0.0, 0, 0.0, 0.0, -1.0, 0.0, 0.0, 0.0, 0.0);
+  add_string_key(key, string, file, index, size, 0.0, 
+                 cache.get_variation(file, index));
+  if (!shaper.get_cached_shape(key.str())) {
+    bool success = shaper.shape_string(string, file, index, size, res, 0.0, 0, 
+                                       0.0, 0.0, -1.0, 0.0, 0.0, 0.0, 0.0, 0.0);
+    if (!success) {
+      return shaper.error_code;
+    }
+    success = shaper.finish_string();
+    if (!success) {
+      return shaper.error_code;
+    }
+    shaper.cache_shape(key.str());
   }
   max_length = max_length < shaper.x_pos.size() ? max_length : shaper.x_pos.size();
   for (unsigned int i = 0; i < max_length; ++i) {
@@ -259,5 +677,6 @@ int string_shape(const char* string, const char* fontfile, int index,
 
 void export_string_metrics(DllInfo* dll){
   R_RegisterCCallable("systemfonts", "string_width", (DL_FUNC)string_width);
+  R_RegisterCCallable("systemfonts", "string_widths", (DL_FUNC)string_widths);
   R_RegisterCCallable("systemfonts", "string_shape", (DL_FUNC)string_shape);
 }
@@ -7,6 +7,8 @@
 #include <cpp11/logicals.hpp>
 #include <R_ext/Rdynload.h>
 
+#include "types.h"
+
 [[cpp11::register]]
 cpp11::list get_string_shape_c(cpp11::strings string, cpp11::integers id, 
                                cpp11::strings path, cpp11::integers index, 
@@ -15,16 +17,23 @@ cpp11::list get_string_shape_c(cpp11::strings string, cpp11::integers id,
                                cpp11::doubles hjust, cpp11::doubles vjust, 
                                cpp11::doubles width, cpp11::doubles tracking, 
                                cpp11::doubles indent, cpp11::doubles hanging, 
-                               cpp11::doubles space_before, cpp11::doubles space_after);
+                               cpp11::doubles space_before, cpp11::doubles space_after,
+                               int threads);
 
 [[cpp11::register]]
 cpp11::doubles get_line_width_c(cpp11::strings string, cpp11::strings path, 
                                 cpp11::integers index, cpp11::doubles size, 
                                 cpp11::doubles res, cpp11::logicals include_bearing);
 
+// Stops the threads kept for parallel shaping
+void unload_shape_workers();
+
 int string_width(const char* string, const char* fontfile, int index, 
                  double size, double res, int include_bearing, double* width);
 
+int string_widths(const char** strings, int n_strings, const FontSettings2* fonts,
+                  const double* size, double res, int include_bearing, double* widths);
+
 int string_shape(const char* string, const char* fontfile, int index, 
                  double size, double res, double* x, double* y, unsigned int max_length);
 
@@ -5,27 +5,25 @@
 #include "types.h"
 #include "caches.h"
 
-UTF_UCS FreetypeShaper::utf_converter = UTF_UCS();
-std::vector<uint32_t> FreetypeShaper::glyph_uc = {};
-std::vector<unsigned int> FreetypeShaper::glyph_id = {};
-std::vector<unsigned int> FreetypeShaper::string_id = {};
-std::vector<long> FreetypeShaper::x_pos = {};
-std::vector<long> FreetypeShaper::y_pos = {};
-std::vector<long> FreetypeShaper::x_mid = {};
-std::vector<long> FreetypeShaper::x_advance = {}; 
-std::vector<long> FreetypeShaper::x_offset = {}; 
-std::vector<long> FreetypeShaper::left_bear = {}; 
-std::vector<long> FreetypeShaper::right_bear = {}; 
-std::vector<long> FreetypeShaper::top_extend = {}; 
-std::vector<long> FreetypeShaper::bottom_extend = {}; 
-std::vector<long> FreetypeShaper::ascenders = {}; 
-std::vector<long> FreetypeShaper::descenders = {}; 
+// Memory budgets of the result caches, split between the threads using them
+static SharedBudget shape_budget(16 * 1024 * 1024);
+static SharedBudget width_budget(4 * 1024 * 1024);
 
 bool FreetypeShaper::shape_string(const char* string, const char* fontfile, 
                                   int index, double size, double res, double lineheight,
                                   int align, double hjust, double vjust, double width,
                                   double tracking, double ind, double hang, double before, 
                                   double after) {
+  return shape_string(string, get_font_cache().file_id(fontfile), index, size, 
+                      res, lineheight, align, hjust, vjust, width, tracking, 
+                      ind, hang, before, after);
+}
+
+bool FreetypeShaper::shape_string(const char* string, FileID fontfile, 
+                                  int index, double size, double res, double lineheight,
+                                  int align, double hjust, double vjust, double width,
+                                  double tracking, double ind, double hang, double before, 
+                                  double after) {
   reset();
   
   FreetypeCache& cache = get_font_cache();
@@ -38,8 +36,8 @@ bool FreetypeShaper::shape_string(const char* string, const char* fontfile,
   int n_glyphs = 0;
   uint32_t* glyphs = utf_converter.convert(string, n_glyphs);
   
-  if (n_glyphs == 0) return true;
-  
+  // The paragraph settings must be set even if the first string is empty so 
+  // they don't carry over from a previous string
   max_width = width;
   indent = ind;
   pen_x = indent;
@@ -68,6 +66,11 @@ bool FreetypeShaper::shape_string(const char* string, const char* fontfile,
 
 bool FreetypeShaper::add_string(const char* string, const char* fontfile, 
                                 int index, double size, double tracking) {
+  return add_string(string, get_font_cache().file_id(fontfile), index, size, tracking);
+}
+
+bool FreetypeShaper::add_string(const char* string, FileID fontfile, 
+                                int index, double size, double tracking) {
   cur_string++;
   int n_glyphs = 0;
   uint32_t* glyphs = utf_converter.convert(string, n_glyphs);
@@ -90,15 +93,30 @@ bool FreetypeShaper::finish_string() {
   if (glyph_id.size() == 0) {
     return true;
   }
-  bool first_char = true;
+  size_t n_glyphs = glyph_id.size();
+  
+  // Pen position of each glyph if the whole string was set on a single line. 
+  // On a line starting at glyph s the position of glyph i is then 
+  // origin + x_cum[i] - x_cum[s] since the first glyph on a line isn't kerned
+  x_cum.resize(n_glyphs);
+  x_cum[0] = 0;
+  for (size_t i = 1; i < n_glyphs; ++i) {
+    x_cum[i] = x_cum[i - 1] + x_advance[i - 1] + x_offset[i];
+  }
+  x_pos.resize(n_glyphs);
+  x_mid.resize(n_glyphs);
+  y_pos.resize(n_glyphs);
+  line_id.resize(n_glyphs);
+  
   bool first_line = true;
   pen_x += indent;
+  size_t line_start = 0;
+  long line_origin = pen_x;
   int last_space = -1;
   long last_nonspace_width = 0;
   long last_nonspace_bear = 0;
   int cur_line = 0;
   double line_height = 0;
-  size_t glyph_counter = 0;
   long max_descend = 0;
   long max_ascend = 0;
   long max_top_extend = 0;
@@ -106,124 +124,122 @@ bool FreetypeShaper::finish_string() {
   long last_max_descend = 0;
   bool no_break_last = true;
   
-  for (unsigned int i = 0; i < glyph_id.size(); ++i) {
+  size_t i = 0;
+  while (i < n_glyphs) {
     bool linebreak = glyph_is_linebreak(glyph_uc[i]);
     bool may_break = glyph_is_breaker(glyph_uc[i]);
-    bool last = i == glyph_id.size() - 1;
-    
-    bool soft_wrap = false;
+    bool last = i == n_glyphs - 1;
+    bool first_char = i == line_start;
+    long pen = line_origin + x_cum[i] - x_cum[line_start];
     
     if (may_break || linebreak) {
       last_space = i; 
       if (no_break_last) {
-        last_nonspace_width = pen_x;
+        // Pen position before kerning is applied
+        last_nonspace_width = first_char ? pen : pen - x_offset[i];
         last_nonspace_bear = i == 0 ? 0 : right_bear[i - 1];
       }
     }
     no_break_last = !may_break;
     
-    // Apply kerning if not the first glyph on the line
-    if (!first_char) {
-      pen_x += x_offset[i];
-    }
-    
-    // Calculate top and bottom extend and ascender/descender
-    
-    
     // Soft wrapping?
-    if (max_width > 0 && !first_char && pen_x + x_advance[i] > max_width && !may_break && !linebreak) {
-      // Rewind to last breaking char and set the soft_wrap flag
-      i = last_space >= 0 ? last_space : i - 1;
-      x_pos.resize(i + 1);
-      x_mid.resize(i + 1);
-      line_id.resize(i + 1);
+    size_t line_end = i;
+    bool soft_wrap = false;
+    if (max_width > 0 && !first_char && pen + x_advance[i] > max_width && !may_break && !linebreak) {
+      // Break at last breaking char, or before this glyph if there is none
+      line_end = last_space >= 0 ? last_space : i - 1;
       soft_wrap = true;
       last = false;
-    } else {
-      // No soft wrap, record pen position
-      x_pos.push_back(pen_x);
-      x_mid.push_back(x_advance[i] / 2);
-      line_id.push_back(cur_line);
+    } else if (!linebreak && !last) {
+      // No line break - glyph stays on the current line
+      ++i;
+      continue;
     }
     
     // If last char update terminal line info
     if (last) {
-      last_nonspace_width = pen_x + x_advance[i];
+      last_nonspace_width = pen + x_advance[i];
       last_nonspace_bear = right_bear[i];
     }
-    if (first_char) {
-      line_left_bear.push_back(left_bear[i]);
-      pen_y -= space_before;
-    }
     
-    // Handle new lines
-    if (linebreak || soft_wrap || last) {
-      // Record and reset line dim info
-      line_right_bear.push_back(last_nonspace_bear);
-      line_width.push_back(last_nonspace_width);
-      last_nonspace_bear = 0;
-      last_nonspace_width = 0;
-      last_space = -1;
-      no_break_last = true;
-      
-      // Calculate line dimensions
-      for (size_t j = glyph_counter; j < x_pos.size(); ++j) {
-        if (max_ascend < ascenders[j]) {
-          max_ascend = ascenders[j];
-        }
-        if (max_top_extend < top_extend[j]) {
-          max_top_extend = top_extend[j];
-        }
-        if (max_descend > descenders[j]) {
-          max_descend = descenders[j];
-        }
-        if (max_bottom_extend > bottom_extend[j]) {
-          max_bottom_extend = bottom_extend[j];
-        }
-      }
-      
-      // Move pen based on indent and line height
-      line_height = (max_ascend - last_max_descend) * cur_lineheight;
-      if (last) {
-        pen_x = (linebreak || soft_wrap) ? 0 : pen_x + x_advance[i];
-      } else {
-        pen_x = soft_wrap ? hanging : indent;
-      }
-      pen_y = first_line ? 0 : pen_y - line_height;
-      bottom -= line_height;
-      // Fill up y_pos based on calculated pen position
-      for (; glyph_counter < x_pos.size(); ++glyph_counter) {
-        y_pos.push_back(pen_y);
+    // Record and reset line dim info
+    line_left_bear.push_back(left_bear[line_start]);
+    pen_y -= space_before;
+    line_right_bear.push_back(last_nonspace_bear);
+    line_width.push_back(last_nonspace_width);
+    last_nonspace_bear = 0;
+    last_nonspace_width = 0;
+    last_space = -1;
+    no_break_last = true;
+    
+    // Position the glyphs on the line and calculate line dimensions
+    long line_shift = line_origin - x_cum[line_start];
+    for (size_t j = line_start; j <= line_end; ++j) {
+      x_pos[j] = line_shift + x_cum[j];
+      x_mid[j] = x_advance[j] / 2;
+      line_id[j] = cur_line;
+      if (max_ascend < ascenders[j]) {
+        max_ascend = ascenders[j];
       }
-      // Move pen_y further down based on paragraph spacing
-      // TODO: Add per string paragraph spacing
-      if (linebreak) {
-        pen_y -= space_after;
-        if (last) {
-          pen_y -= line_height;
-          bottom -= line_height;
-        }
+      if (max_top_extend < top_extend[j]) {
+        max_top_extend = top_extend[j];
       }
-      if (first_line) {
-        top_border = max_ascend;
-        top_bearing = top_border - max_top_extend;
+      if (max_descend > descenders[j]) {
+        max_descend = descenders[j];
       }
-      // Reset flags and counters
-      last_max_descend = max_descend;
-      if (!last) {
-        max_ascend = 0;
-        max_descend = 0;
-        max_top_extend = 0;
-        max_bottom_extend = 0;
-        first_line = false;
-        cur_line++;
-        first_char = true;
+      if (max_bottom_extend > bottom_extend[j]) {
+        max_bottom_extend = bottom_extend[j];
       }
+    }
+    
+    // Move pen based on indent and line height
+    line_height = (max_ascend - last_max_descend) * cur_lineheight;
+    if (last) {
+      pen_x = linebreak ? 0 : pen + x_advance[i];
     } else {
-      // No line break - advance the pen
-      pen_x += x_advance[i];
-      first_char = false;
+      pen_x = soft_wrap ? hanging : indent;
     }
+    pen_y = first_line ? 0 : pen_y - line_height;
+    bottom -= line_height;
+    // Fill up y_pos based on calculated pen position
+    for (size_t j = line_start; j <= line_end; ++j) {
+      y_pos[j] = pen_y;
+    }
+    // Move pen_y further down based on paragraph spacing
+    // TODO: Add per string paragraph spacing
+    if (linebreak) {
+      pen_y -= space_after;
+      if (last) {
+        pen_y -= line_height;
+        bottom -= line_height;
+      }
+    }
+    if (first_line) {
+      top_border = max_ascend;
+      top_bearing = top_border - max_top_extend;
+    }
+    // Reset flags and counters
+    last_max_descend = max_descend;
+    if (!last) {
+      max_ascend = 0;
+      max_descend = 0;
+      max_top_extend = 0;
+      max_bottom_extend = 0;
+      first_line = false;
+      cur_line++;
+    }
+    
+    line_start = line_end + 1;
+    line_origin = pen_x;
+    if (!soft_wrap) {
+      ++i;
+    } else if (line_origin - x_cum[line_start] > line_shift) {
+      // The glyphs carried over to the new line moved right, so they may no 
+      // longer fit and must be checked again
+      i = line_start;
+    }
+    // Otherwise the carried over glyphs moved left and are known to fit, so 
+    // continue with the glyph that triggered the wrap
   }
   height = top_border - bottom - max_descend;
   bottom_bearing = max_bottom_extend - max_descend;
@@ -263,11 +279,58 @@ bool FreetypeShaper::finish_string() {
 bool FreetypeShaper::single_line_width(const char* string, const char* fontfile, 
                                        int index, double size, double res, 
                                        bool include_bearing, long& width) {
+  return single_line_width(string, get_font_cache().file_id(fontfile), index, 
+                           size, res, include_bearing, width);
+}
+
+bool FreetypeShaper::single_line_width(const char* string, FileID fontfile, 
+                                       int index, double size, double res, 
+                                       bool include_bearing, long& width) {
+  if (string == NULL || string[0] == '\0') {
+    width = 0;
+    return true;
+  }
+  
+  FreetypeCache& cache = get_font_cache();
+  
+  ResultKey key;
+  key.add(string);
+  key.add((int) fontfile);
+  key.add(index);
+  key.add(size);
+  key.add(res);
+  key.add((int) include_bearing);
+  key.add(cache.get_variation(fontfile, index));
+  WidthCache& width_cache = get_width_cache();
+  const long* cached_width = width_cache.get(key.str());
+  if (cached_width != nullptr) {
+    width = *cached_width;
+    return true;
+  }
+  
+  bool success = cache.load_font(fontfile, index, size, res);
+  if (!success) {
+    error_code = cache.error_code;
+    return false;
+  }
+  
+  success = single_line_width(string, cache, include_bearing, width);
+  if (success) {
+    width_cache.add(key.str(), width);
+  }
+  return success;
+}
+
+// Assumes that the font has already been loaded into the cache
+bool FreetypeShaper::single_line_width(const char* string, FreetypeCache& cache, 
+                                       bool include_bearing, long& width) {
   long x = 0;
   long y = 0;
   long left_bear = 0;
   int error_c = 0;
+  bool success = false;
   GlyphInfo metrics = {};
+  FT_UInt last_id = 0;
   
   int n_glyphs = 0;
   uint32_t* glyphs = utf_converter.convert(string, n_glyphs);
@@ -277,13 +340,6 @@ bool FreetypeShaper::single_line_width(const char* string, const char* fontfile,
     return true;
   }
   
-  FreetypeCache& cache = get_font_cache();
-  bool success = cache.load_font(fontfile, index, size, res);
-  if (!success) {
-    error_code = cache.error_code;
-    return false;
-  }
-  
   for (int i = 0; i < n_glyphs; ++i) {
     metrics = cache.cached_glyph_info(glyphs[i], error_c);
     if (error_c != 0) {
@@ -291,7 +347,7 @@ bool FreetypeShaper::single_line_width(const char* string, const char* fontfile,
       return false;
     }
     if (i != 0) {
-      success = cache.apply_kerning(glyphs[i - 1], glyphs[i], x, y);
+      success = cache.apply_kerning(last_id, metrics.index, x, y);
       if (!success) {
         error_code = cache.error_code;
         return false;
@@ -299,6 +355,7 @@ bool FreetypeShaper::single_line_width(const char* string, const char* fontfile,
     } else {
       left_bear = metrics.x_bearing;
     }
+    last_id = metrics.index;
     x += metrics.x_advance;
   }
   
@@ -310,6 +367,51 @@ bool FreetypeShaper::single_line_width(const char* string, const char* fontfile,
   return true;
 }
 
+bool FreetypeShaper::get_cached_shape(const std::string& key) {
+  const ShapeResult* result = get_shape_cache().get(key);
+  if (result == nullptr) {
+    return false;
+  }
+  glyph_uc = result->glyph_uc;
+  glyph_id = result->glyph_id;
+  string_id = result->string_id;
+  x_pos = result->x_pos;
+  y_pos = result->y_pos;
+  x_mid = result->x_mid;
+  width = result->width;
+  height = result->height;
+  left_bearing = result->left_bearing;
+  right_bearing = result->right_bearing;
+  top_bearing = result->top_bearing;
+  bottom_bearing = result->bottom_bearing;
+  top_border = result->top_border;
+  left_border = result->left_border;
+  pen_x = result->pen_x;
+  pen_y = result->pen_y;
+  return true;
+}
+
+void FreetypeShaper::cache_shape(const std::string& key) {
+  ShapeResult result;
+  result.glyph_uc = glyph_uc;
+  result.glyph_id = glyph_id;
+  result.string_id = string_id;
+  result.x_pos = x_pos;
+  result.y_pos = y_pos;
+  result.x_mid = x_mid;
+  result.width = width;
+  result.height = height;
+  result.left_bearing = left_bearing;
+  result.right_bearing = right_bearing;
+  result.top_bearing = top_bearing;
+  result.bottom_bearing = bottom_bearing;
+  result.top_border = top_border;
+  result.left_border = left_border;
+  result.pen_x = pen_x;
+  result.pen_y = pen_y;
+  get_shape_cache().add(key, std::move(result));
+}
+
 void FreetypeShaper::reset() {
   glyph_uc.clear();
   glyph_id.clear();
@@ -327,6 +429,7 @@ void FreetypeShaper::reset() {
   line_right_bear.clear();
   line_width.clear();
   line_id.clear();
+  x_cum.clear();
   ascenders.clear();
   descenders.clear();
   
@@ -375,7 +478,7 @@ bool FreetypeShaper::shape_glyphs(uint32_t* glyphs, int n_glyphs, FreetypeCache&
     if (i == 0) {
       x_offset.push_back(0);
     } else {
-      success = cache.get_kerning(glyphs[i - 1], glyphs[i], delta_x, delta_y);
+      success = cache.get_kerning(old_metrics.index, metrics.index, delta_x, delta_y);
       if (!success) {
         error_code = cache.error_code;
         return false;
@@ -397,3 +500,15 @@ bool FreetypeShaper::shape_glyphs(uint32_t* glyphs, int n_glyphs, FreetypeCache&
   }
   return true;
 }
+
+ShapeCache& get_shape_cache() {
+  static thread_local ShapeCache shape_cache(shape_budget);
+  shape_cache.check_budget();
+  return shape_cache;
+}
+
+WidthCache& get_width_cache() {
+  static thread_local WidthCache width_cache(width_budget);
+  width_cache.check_budget();
+  return width_cache;
+}
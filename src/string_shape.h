@@ -14,10 +14,17 @@
 
 #include "utils.h"
 #include "ft_cache.h"
+#include "cache_shape.h"
 
 class FreetypeShaper {
 public:
   FreetypeShaper() :
+    glyph_uc(),
+    glyph_id(),
+    string_id(),
+    x_pos(),
+    y_pos(),
+    x_mid(),
     width(0),
     height(0),
     left_bearing(0),
@@ -29,16 +36,26 @@ public:
     pen_x(0),
     pen_y(0),
     error_code(0),
+    utf_converter(),
     cur_lineheight(0.0),
     cur_align(0),
     cur_string(0),
     cur_hjust(0.0),
     cur_vjust(0.0),
     cur_res(0.0),
+    x_advance(),
+    x_offset(),
+    left_bear(),
+    right_bear(),
+    top_extend(),
+    bottom_extend(),
+    ascenders(),
+    descenders(),
     line_left_bear(),
     line_right_bear(),
     line_width(),
     line_id(),
+    x_cum(),
     top(0),
     bottom(0),
     ascend(0),
@@ -51,12 +68,12 @@ public:
   {};
   ~FreetypeShaper() {};
   
-  static std::vector<uint32_t> glyph_uc;
-  static std::vector<unsigned int> glyph_id;
-  static std::vector<unsigned int> string_id;
-  static std::vector<long> x_pos;
-  static std::vector<long> y_pos;
-  static std::vector<long> x_mid;
+  std::vector<uint32_t> glyph_uc;
+  std::vector<unsigned int> glyph_id;
+  std::vector<unsigned int> string_id;
+  std::vector<long> x_pos;
+  std::vector<long> y_pos;
+  std::vector<long> x_mid;
   long width;
   long height;
   long left_bearing;
@@ -75,33 +92,48 @@ public:
                     int align, double hjust, double vjust, double width,
                     double tracking, double ind, double hang, double before, 
                     double after);
+  bool shape_string(const char* string, FileID fontfile, int index, 
+                    double size, double res, double lineheight,
+                    int align, double hjust, double vjust, double width,
+                    double tracking, double ind, double hang, double before, 
+                    double after);
   bool add_string(const char* string, const char* fontfile, int index, 
                   double size, double tracking);
+  bool add_string(const char* string, FileID fontfile, int index, 
+                  double size, double tracking);
   bool finish_string();
   
   bool single_line_width(const char* string, const char* fontfile, int index, 
                          double size, double res, bool include_bearing, long& width);
+  bool single_line_width(const char* string, FileID fontfile, int index, 
+                         double size, double res, bool include_bearing, long& width);
+  bool single_line_width(const char* string, FreetypeCache& cache, 
+                         bool include_bearing, long& width);
+  
+  bool get_cached_shape(const std::string& key);
+  void cache_shape(const std::string& key);
   
 private:
-  static UTF_UCS utf_converter;
+  UTF_UCS utf_converter;
   double cur_lineheight;
   int cur_align;
   unsigned int cur_string;
   double cur_hjust;
   double cur_vjust;
   double cur_res;
-  static std::vector<long> x_advance; 
-  static std::vector<long> x_offset; 
-  static std::vector<long> left_bear; 
-  static std::vector<long> right_bear; 
-  static std::vector<long> top_extend; 
-  static std::vector<long> bottom_extend; 
-  static std::vector<long> ascenders; 
-  static std::vector<long> descenders; 
+  std::vector<long> x_advance; 
+  std::vector<long> x_offset; 
+  std::vector<long> left_bear; 
+  std::vector<long> right_bear; 
+  std::vector<long> top_extend; 
+  std::vector<long> bottom_extend; 
+  std::vector<long> ascenders; 
+  std::vector<long> descenders; 
   std::vector<long> line_left_bear; 
   std::vector<long> line_right_bear;
   std::vector<long> line_width;
   std::vector<long> line_id;
+  std::vector<long> x_cum;
   
   long top;
   long bottom;
@@ -154,3 +186,7 @@ private:
     return false;
   }
 };
+
+// Shaping results are cached per thread, like the FreeType cache
+ShapeCache& get_shape_cache();
+WidthCache& get_width_cache();
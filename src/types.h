@@ -51,12 +51,25 @@ struct FontSettings2 : public FontSettings {
     n_features = x.n_features;
   }
 };
+// Counters for a cache as passed through the C interface
+struct FontCacheStats {
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+  size_t entries;
+  size_t bytes;
+};
+// Time spent in a FreeType operation as passed through the C interface
+struct FontTimingStats {
+  size_t calls;
+  double seconds;
+};
 // A collection of registered fonts
 typedef std::unordered_map<std::string, FontCollection> FontReg;
-// A map of Emoji unicode points
-typedef std::unordered_map<uint32_t, uint8_t> EmojiMap;
 // A map for keeping font linking on Windows
 typedef std::unordered_map<std::string, std::vector<std::string> > WinLinkMap;
+// Positions in a font list keyed by lower case family or postscript name
+typedef std::unordered_map<std::string, std::vector<size_t> > FontIndex;
 
 // Key for looking up cached font locations
 struct FontKey {
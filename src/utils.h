@@ -3,6 +3,7 @@
 #include <cstring>
 #include <cctype>
 #include <cstdint>
+#include <string>
 #include <vector>
 #include <exception>
 #include <algorithm>
@@ -36,6 +37,12 @@ const static long WDTH_TAG = 2003072104;
 const static long ITAL_TAG = 1769234796;
 const static double FIXED_MOD = 65536.0;
 
+// Case folding used for font names. Anything that compares or indexes names
+// without regard to case must go through this so they agree on non-ASCII bytes
+inline char fold_char(char c) {
+  return (char) tolower((unsigned char) c);
+}
+
 inline bool strcmp_no_case(const char * A, const char * B) {
   if (A == NULL && B == NULL) return true;
   if (A == NULL || B == NULL) return false;
@@ -43,11 +50,22 @@ inline bool strcmp_no_case(const char * A, const char * B) {
   if (strlen(B) != a_len)
     return false;
   for (unsigned int i = 0; i < a_len; ++i)
-    if (tolower(A[i]) != tolower(B[i]))
+    if (fold_char(A[i]) != fold_char(B[i]))
       return false;
   return true;
 }
 
+// The folded form of a name, used as key in the font name indexes. The result
+// is only valid until the next call
+inline const std::string& fold_case(const char* name) {
+  static std::string folded;
+  folded.clear();
+  for (const char* c = name; *c != '\0'; ++c) {
+    folded.push_back(fold_char(*c));
+  }
+  return folded;
+}
+
 
 
 /*
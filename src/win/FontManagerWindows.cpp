@@ -146,7 +146,7 @@ int scan_font_reg() {
 
 void resetFontCache() {
   ResultSet& font_list = get_font_list();
-  font_list.clear();
+  font_list.delete_all();
   WinLinkMap& font_links = get_win_link_map();
   font_links.clear();
 }
@@ -172,13 +172,13 @@ bool resultMatches(FontDescriptor *result, FontDescriptor *desc) {
   if (desc->style && !strcmp_no_case(desc->style, result->style))
     return false;
 
-  if (!result->var_wght && desc->weight && desc->weight != result->weight)
+  if (desc->weight && desc->weight != result->weight && !result->has_var_wght())
     return false;
 
-  if (!result->var_wdth && desc->width && desc->width != result->width)
+  if (desc->width && desc->width != result->width && !result->has_var_wdth())
     return false;
 
-  if (!result->var_ital && desc->italic != result->italic)
+  if (desc->italic != result->italic && !result->has_var_ital())
     return false;
 
   return true;